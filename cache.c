@@ -0,0 +1,387 @@
+#include <pthread.h>
+#include <string.h>
+#include <strings.h>
+#include "ntfs_recover.h"
+#include "cache.h"
+#include "direct.h"
+
+#define CACHE_BLOCK_SIZE	(64 << 10)	/* Unless clusters are larger */
+#define CACHE_MAX_SHARDS	64
+#define CACHE_RA_BLOCKS		8		/* Read-ahead window in blocks */
+#define CACHE_BYPASS_SHARE	16		/* Reads over this share of the
+						   budget skip the cache */
+#define CACHE_STREAM_SHARE	8		/* Share of a shard that blocks
+						   of sequential readers get */
+
+/* One cluster-aligned block of the device */
+struct cache_block {
+   struct list_head  lru;		/* Position in the shard's LRU or stream
+					   list */
+   struct cache_block *hnext;		/* Next block in the hash chain */
+   u64               blk;		/* Block number (byte offset / size) */
+   u8                *data;
+   int               stream;		/* On the stream list */
+};
+
+/*
+ * Blocks are spread over the shards by hash, each shard with its own lock,
+ * LRU list and share of the budget, so concurrent readers rarely meet on
+ * the same lock.  Aligned so two shards never share a cache line.
+ *
+ * Blocks read for a sequential reader go on the stream list instead, a
+ * FIFO of at most @max_stream blocks that only recycles its own, so one
+ * pass over a large file or $MFT cannot push the hot metadata out.  A
+ * block on it joins the LRU list once a reader that is not streaming
+ * hits it.
+ */
+struct cache_shard {
+   pthread_mutex_t   lock;
+   struct list_head  lru;		/* Most recently used first */
+   struct list_head  stream;		/* Most recently read first */
+   struct cache_block **hash;
+   u32               hash_mask;
+   u32               nr_blocks;
+   u32               max_blocks;
+   u32               nr_stream;
+   u32               max_stream;
+   struct ntfs_cache_stats stats;
+} __attribute__((aligned(64)));
+
+struct ntfs_cache {
+   struct ntfs_device *dev;
+   u32               block_size;
+   u8                block_size_bits;
+   u8                cluster_size_bits;
+   u32               shard_mask;
+   struct cache_shard *shards;
+   s64               bypass_size;
+   u64               bypassed;
+};
+
+/* Per thread sequential read detection */
+static __thread struct {
+   struct ntfs_cache *cache;
+   u64               next;		/* Block a sequential reader wants next */
+   u64               hint_start;	/* Blocks hinted by ntfs_cache_hint() */
+   u64               hint_end;
+} ra;
+
+static struct cache_shard *block_shard(struct ntfs_cache *cache, u64 blk)
+{
+   return &cache->shards[((blk * 0x9e3779b97f4a7c15ULL) >> 40)
+      & cache->shard_mask];
+}
+
+static struct cache_block **block_slot(struct cache_shard *shard, u64 blk)
+{
+   struct cache_block **slot = &shard->hash[blk & shard->hash_mask];
+
+   while(*slot && (*slot)->blk != blk)
+      slot = &(*slot)->hnext;
+   return slot;
+}
+
+struct ntfs_cache *ntfs_cache_alloc(struct ntfs_device *dev,
+      u32 cluster_size, size_t budget)
+{
+   struct ntfs_cache *cache = calloc(1, sizeof(struct ntfs_cache));
+   u32 nr_shards = 1, hash_size = 1;
+
+   if(cache == NULL)
+      return NULL;
+   cache->dev = dev;
+   cache->block_size = cluster_size > CACHE_BLOCK_SIZE ?
+      cluster_size : CACHE_BLOCK_SIZE;
+   cache->block_size_bits = ffs(cache->block_size) - 1;
+   cache->cluster_size_bits = ffs(cluster_size) - 1;
+
+   /*
+    * A read of a whole read-ahead window is as large a request as the
+    * cache would make, and read once; copying it through gains nothing
+    */
+   cache->bypass_size = budget / CACHE_BYPASS_SHARE;
+   if(cache->bypass_size > (s64)CACHE_RA_BLOCKS << cache->block_size_bits)
+      cache->bypass_size = (s64)CACHE_RA_BLOCKS << cache->block_size_bits;
+   if(cache->bypass_size < cache->block_size)
+      cache->bypass_size = cache->block_size;
+
+   size_t max_blocks = budget / cache->block_size;
+   if(max_blocks == 0)
+      max_blocks = 1;
+   while(nr_shards < CACHE_MAX_SHARDS && nr_shards * 2 <= max_blocks)
+      nr_shards *= 2;
+   while(hash_size < 2 * max_blocks / nr_shards)
+      hash_size *= 2;
+   cache->shard_mask = nr_shards - 1;
+   cache->shards = aligned_alloc(64, nr_shards * sizeof(struct cache_shard));
+   if(cache->shards == NULL)
+   {
+      free(cache);
+      return NULL;
+   }
+   memset(cache->shards, 0, nr_shards * sizeof(struct cache_shard));
+   for(u32 i = 0; i < nr_shards; i++)
+   {
+      struct cache_shard *shard = &cache->shards[i];
+      pthread_mutex_init(&shard->lock, NULL);
+      INIT_LIST_HEAD(&shard->lru);
+      INIT_LIST_HEAD(&shard->stream);
+      shard->max_blocks = max_blocks / nr_shards;
+      shard->max_stream = shard->max_blocks / CACHE_STREAM_SHARE;
+      if(shard->max_stream == 0)
+         shard->max_stream = 1;
+      shard->hash_mask = hash_size - 1;
+      shard->hash = calloc(hash_size, sizeof(*shard->hash));
+      if(shard->hash == NULL)
+      {
+         cache->shard_mask = i;
+         ntfs_cache_free(cache);
+         return NULL;
+      }
+   }
+   return cache;
+}
+
+void ntfs_cache_free(struct ntfs_cache *cache)
+{
+   struct list_head *item, *tmp;
+
+   if(cache == NULL)
+      return;
+   for(u32 i = 0; i <= cache->shard_mask; i++)
+   {
+      struct cache_shard *shard = &cache->shards[i];
+      list_splice(&shard->stream, &shard->lru);
+      list_for_each_safe(item, tmp, &shard->lru)
+      {
+         struct cache_block *block = list_entry(item, struct cache_block, lru);
+         free(block->data);
+         free(block);
+      }
+      free(shard->hash);
+      pthread_mutex_destroy(&shard->lock);
+   }
+   free(cache->shards);
+   free(cache);
+}
+
+/*
+ * Copy part of block @blk to @buf if it is cached.  Returns 0 on a hit.
+ * A @streaming reader leaves the block where it is on the stream list.
+ */
+static int cache_lookup(struct ntfs_cache *cache, u64 blk, u32 ofs, u32 n,
+      u8 *buf, int streaming)
+{
+   struct cache_shard *shard = block_shard(cache, blk);
+   struct cache_block *block;
+
+   pthread_mutex_lock(&shard->lock);
+   block = *block_slot(shard, blk);
+   if(block == NULL)
+   {
+      shard->stats.misses++;
+      pthread_mutex_unlock(&shard->lock);
+      return -1;
+   }
+   if(!block->stream || !streaming)
+   {
+      if(block->stream)
+         shard->nr_stream--;
+      block->stream = 0;
+      list_del(&block->lru);
+      list_add(&block->lru, &shard->lru);
+   }
+   memcpy(buf, block->data + ofs, n);
+   shard->stats.hits++;
+   pthread_mutex_unlock(&shard->lock);
+   return 0;
+}
+
+/* Unhash and unlink the oldest block of @list */
+static struct cache_block *cache_evict(struct cache_shard *shard,
+      struct list_head *list)
+{
+   struct cache_block *block = list_entry(list->prev, struct cache_block,
+         lru);
+
+   list_del(&block->lru);
+   *block_slot(shard, block->blk) = block->hnext;
+   if(block->stream)
+      shard->nr_stream--;
+   shard->stats.evictions++;
+   return block;
+}
+
+/*
+ * Store a copy of @data as block @blk.  A block for a @streaming reader
+ * goes on the stream list, and takes the place of the oldest block there
+ * once that is full; otherwise the LRU block goes when the shard is full.
+ */
+static void cache_insert(struct ntfs_cache *cache, u64 blk, const u8 *data,
+      int readahead, int streaming)
+{
+   struct cache_shard *shard = block_shard(cache, blk);
+   struct cache_block *block, **slot;
+
+   pthread_mutex_lock(&shard->lock);
+   slot = block_slot(shard, blk);
+   if(*slot)
+   {
+      pthread_mutex_unlock(&shard->lock);
+      return;
+   }
+   if(streaming && shard->nr_stream >= shard->max_stream)
+   {
+      block = cache_evict(shard, &shard->stream);
+      slot = block_slot(shard, blk);
+   }
+   else if(shard->nr_blocks < shard->max_blocks)
+   {
+      block = malloc(sizeof(struct cache_block));
+      if(block && (block->data = malloc(cache->block_size)) == NULL)
+      {
+         free(block);
+         block = NULL;
+      }
+      if(block == NULL)
+      {
+         pthread_mutex_unlock(&shard->lock);
+         return;
+      }
+      shard->nr_blocks++;
+   }
+   else
+   {
+      block = cache_evict(shard, list_empty(&shard->lru) ? &shard->stream
+            : &shard->lru);
+      slot = block_slot(shard, blk);
+   }
+   block->blk = blk;
+   block->hnext = NULL;
+   block->stream = streaming;
+   *slot = block;
+   list_add(&block->lru, streaming ? &shard->stream : &shard->lru);
+   shard->nr_stream += streaming;
+   memcpy(block->data, data, cache->block_size);
+   if(readahead)
+      shard->stats.readahead++;
+   pthread_mutex_unlock(&shard->lock);
+}
+
+/* Whether this thread reads block @blk in order, or inside its hint */
+static int ra_streaming(struct ntfs_cache *cache, u64 blk)
+{
+   if(ra.cache != cache)
+   {
+      ra.cache = cache;
+      ra.next = ra.hint_start = ra.hint_end = 0;
+   }
+   return (blk >= ra.hint_start && blk < ra.hint_end)
+      || (blk == ra.next && blk);
+}
+
+/*
+ * Read block @blk from the device.  A @streaming thread gets the following
+ * blocks read in the same request, up to the end of the range it hinted.
+ * No shard lock is held while waiting on the device.
+ */
+static int cache_fill(struct ntfs_cache *cache, u64 blk, u32 ofs, u32 n,
+      u8 *buf, int streaming)
+{
+   u32 nr = 1;
+   u8 *data;
+
+   if(blk >= ra.hint_start && blk < ra.hint_end)
+      nr = ra.hint_end - blk < CACHE_RA_BLOCKS ? ra.hint_end - blk
+         : CACHE_RA_BLOCKS;
+   else if(streaming)
+      nr = CACHE_RA_BLOCKS;
+
+   data = ntfs_io_buf_alloc((size_t)nr << cache->block_size_bits);
+   if(data == NULL)
+      return -1;
+   s64 len = (s64)nr << cache->block_size_bits;
+   s64 got = ntfs_device_pread(cache->dev, blk << cache->block_size_bits,
+         len, data);
+   if(got < 0)
+   {
+      free(data);
+      return -1;
+   }
+   /* Past the end of the device reads back as zeroes */
+   memset(data + got, 0, len - got);
+   for(u32 i = 0; i < nr; i++)
+      cache_insert(cache, blk + i, data + ((size_t)i << cache->block_size_bits),
+            i > 0, streaming);
+   memcpy(buf, data + ofs, n);
+   free(data);
+   return 0;
+}
+
+/**
+ * ntfs_cache_pread - read @count bytes at device offset @pos through @cache
+ *
+ * Reads of a whole read-ahead window, or of a sixteenth of the budget if
+ * that is less, go straight to the device.  Returns @count, or -1 if the
+ * device could not be read.
+ */
+s64 ntfs_cache_pread(struct ntfs_cache *cache, s64 pos, s64 count, void *b)
+{
+   u8 *buf = (u8 *)b;
+   s64 total = count;
+
+   if(count > cache->bypass_size)
+   {
+      __atomic_fetch_add(&cache->bypassed, 1, __ATOMIC_RELAXED);
+      return ntfs_device_pread(cache->dev, pos, count, b);
+   }
+   while(count > 0)
+   {
+      u64 blk = pos >> cache->block_size_bits;
+      u32 ofs = pos & (cache->block_size - 1);
+      u32 n = cache->block_size - ofs < count ?
+         cache->block_size - ofs : count;
+      int streaming = ra_streaming(cache, blk);
+      if(cache_lookup(cache, blk, ofs, n, buf, streaming) < 0
+            && cache_fill(cache, blk, ofs, n, buf, streaming) < 0)
+         return -1;
+      ra.next = blk + 1;
+      buf += n;
+      pos += n;
+      count -= n;
+   }
+   return total;
+}
+
+/**
+ * ntfs_cache_hint - announce a sequential read of a cluster range
+ *
+ * The calling thread is about to read @nr_clusters clusters from @lcn in
+ * order, so misses inside that range read ahead, but never beyond it.
+ */
+void ntfs_cache_hint(struct ntfs_cache *cache, LCN lcn, s64 nr_clusters)
+{
+   u8 shift = cache->block_size_bits - cache->cluster_size_bits;
+
+   ra.cache = cache;
+   ra.hint_start = (u64)lcn >> shift;
+   ra.hint_end = ((u64)(lcn + nr_clusters) + (1ULL << shift) - 1) >> shift;
+   ra.next = ra.hint_start;
+}
+
+void ntfs_cache_get_stats(struct ntfs_cache *cache,
+      struct ntfs_cache_stats *stats)
+{
+   memset(stats, 0, sizeof(*stats));
+   for(u32 i = 0; i <= cache->shard_mask; i++)
+   {
+      struct cache_shard *shard = &cache->shards[i];
+      pthread_mutex_lock(&shard->lock);
+      stats->hits += shard->stats.hits;
+      stats->misses += shard->stats.misses;
+      stats->readahead += shard->stats.readahead;
+      stats->evictions += shard->stats.evictions;
+      pthread_mutex_unlock(&shard->lock);
+   }
+   stats->bypassed = __atomic_load_n(&cache->bypassed, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,35 @@
+/*
+ * cache.h - Cluster block cache shared by all readers of a device.
+ */
+
+#ifndef _NTFS_CACHE_H
+#define _NTFS_CACHE_H
+
+#include <stddef.h>
+#include "type.h"
+
+struct ntfs_device;
+struct ntfs_cache;
+
+/* Default memory budget of the block cache */
+#define CACHE_DEFAULT_BUDGET	(64 << 20)
+
+/**
+ * struct ntfs_cache_stats - counters summed over all shards of a cache
+ */
+struct ntfs_cache_stats {
+	u64 hits;		/* Blocks served from memory. */
+	u64 misses;		/* Blocks that had to come from the device. */
+	u64 readahead;		/* Blocks read ahead of a sequential reader. */
+	u64 evictions;		/* Blocks dropped to stay within budget. */
+	u64 bypassed;		/* Large streaming reads sent straight to the
+				   device. */
+};
+
+struct ntfs_cache *ntfs_cache_alloc(struct ntfs_device *, u32, size_t);
+void ntfs_cache_free(struct ntfs_cache *);
+s64 ntfs_cache_pread(struct ntfs_cache *, s64, s64, void *);
+void ntfs_cache_hint(struct ntfs_cache *, LCN, s64);
+void ntfs_cache_get_stats(struct ntfs_cache *, struct ntfs_cache_stats *);
+
+#endif /* defined _NTFS_CACHE_H */
@@ -0,0 +1,547 @@
+#include <pthread.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "ntfs_recover.h"
+#include "carve.h"
+#include "direct.h"
+
+#define CARVE_SEGMENT	65536		/* Clusters handed to a worker at once */
+#define CARVE_CHUNK	(4 << 20)	/* Bytes read from the device at once */
+
+/**
+ * struct carve_sig - what a file type looks like from the outside
+ * @type:	short name, also the usual extension
+ * @header:	magic at the start of the first cluster
+ * @mask:	0xff for header bytes that must match, 0 for wildcards
+ * @footer:	bytes that end the file, if the type has any
+ * @extra:	bytes of the file following the footer
+ * @max_size:	where to give up looking for the end
+ * @size:	reads the file size out of the header for types that have it
+ */
+struct carve_sig {
+   const char *type;
+   u8         header[16];
+   u8         mask[16];
+   int        header_len;
+   u8         footer[8];
+   int        footer_len;
+   int        extra;
+   s64        max_size;
+   s64        (*size)(const u8 *, u32);
+};
+
+static inline u32 be16(const u8 *p) { return (p[0] << 8) | p[1]; }
+static inline u32 be32(const u8 *p) { return (u32)be16(p) << 16 | be16(p + 2); }
+static inline u32 le16(const u8 *p) { return p[0] | (p[1] << 8); }
+static inline u32 le32(const u8 *p) { return le16(p) | (u32)le16(p + 2) << 16; }
+static inline u64 le64(const u8 *p) { return le32(p) | (u64)le32(p + 4) << 32; }
+
+static s64 sqlite_size(const u8 *p, u32 len)
+{
+   u32 page_size = be16(p + 16);
+
+   if(len < 100 || be32(p + 24) != be32(p + 92))
+      return -1;
+   if(page_size == 1)
+      page_size = 65536;
+   return (s64)page_size * be32(p + 28);
+}
+
+static s64 sevenzip_size(const u8 *p, u32 len)
+{
+   u64 ofs = le64(p + 12), size = le64(p + 20);
+
+   /* Both are checked against max_size later, this only keeps the sum
+      from overflowing */
+   if(len < 32 || ofs > 1ULL << 48 || size > 1ULL << 48)
+      return -1;
+   return 32 + ofs + size;
+}
+
+static s64 pst_size(const u8 *p, u32 len)
+{
+   if(len < 0xc0)
+      return -1;
+   /* wVer >= 23 is the Unicode format with 64-bit offsets */
+   if(le16(p + 10) >= 23)
+      return le64(p + 0xb8) > 1ULL << 62 ? -1 : (s64)le64(p + 0xb8);
+   return le32(p + 0xa8);
+}
+
+#define MASK(n)	{ [0 ... (n) - 1] = 0xff }
+
+static struct carve_sig sigs[] = {
+   { "jpg", { 0xff, 0xd8, 0xff }, MASK(3), 3,
+      { 0xff, 0xd9 }, 2, 0, 32 << 20, NULL },
+   { "png", { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' }, MASK(8), 8,
+      { 'I', 'E', 'N', 'D', 0xae, 0x42, 0x60, 0x82 }, 8, 0, 64 << 20, NULL },
+   { "gif", { 'G', 'I', 'F', '8', 0, 'a' },
+      { 0xff, 0xff, 0xff, 0xff, 0, 0xff }, 6,
+      { 0x00, 0x3b }, 2, 0, 16 << 20, NULL },
+   { "pdf", { '%', 'P', 'D', 'F', '-' }, MASK(5), 5,
+      { '%', '%', 'E', 'O', 'F' }, 5, 1, 256 << 20, NULL },
+   /* ZIP, and with it docx/xlsx/pptx/odt/jar; the end of central
+      directory record is 22 bytes plus a comment we do not size */
+   { "zip", { 'P', 'K', 0x03, 0x04 }, MASK(4), 4,
+      { 'P', 'K', 0x05, 0x06 }, 4, 18, 1LL << 30, NULL },
+   /* OLE2 compound file: doc, xls, ppt, msg */
+   { "ole", { 0xd0, 0xcf, 0x11, 0xe0, 0xa1, 0xb1, 0x1a, 0xe1 }, MASK(8), 8,
+      { 0 }, 0, 0, 64 << 20, NULL },
+   { "pst", { '!', 'B', 'D', 'N' }, MASK(4), 4,
+      { 0 }, 0, 0, 50LL << 30, pst_size },
+   { "sqlite", "SQLite format 3", MASK(16), 16,
+      { 0 }, 0, 0, 1LL << 40, sqlite_size },
+   { "7z", { '7', 'z', 0xbc, 0xaf, 0x27, 0x1c }, MASK(6), 6,
+      { 0 }, 0, 0, 1LL << 40, sevenzip_size },
+   { "rar", { 'R', 'a', 'r', '!', 0x1a, 0x07 }, MASK(6), 6,
+      { 0 }, 0, 0, 1LL << 30, NULL },
+};
+
+#define NR_SIGS	(int)(sizeof(sigs) / sizeof(sigs[0]))
+
+/* Signatures that can start with a given byte, as a bit per signature */
+static u32 first_byte[256];
+
+#ifdef __SSE2__
+static __m128i sig_header[NR_SIGS];
+static __m128i sig_mask[NR_SIGS];
+#endif
+
+static void init_sigs(void)
+{
+   for(int i = 0; i < NR_SIGS; i++)
+   {
+      for(int c = 0; c < 256; c++)
+         if((c & sigs[i].mask[0]) == sigs[i].header[0])
+            first_byte[c] |= 1U << i;
+#ifdef __SSE2__
+      sig_header[i] = _mm_loadu_si128((const __m128i *)sigs[i].header);
+      sig_mask[i] = _mm_loadu_si128((const __m128i *)sigs[i].mask);
+#endif
+   }
+}
+
+/*
+ * Files start on a cluster boundary, so only the first 16 bytes of each
+ * free cluster are matched, against every candidate signature at once.
+ * Returns the index of the signature or -1.
+ */
+static int match_header(const u8 *p)
+{
+   u32 cand = first_byte[p[0]];
+
+   if(cand == 0)
+      return -1;
+#ifdef __SSE2__
+   __m128i v = _mm_loadu_si128((const __m128i *)p);
+   for(; cand; cand &= cand - 1)
+   {
+      int i = __builtin_ctz(cand);
+      __m128i eq = _mm_cmpeq_epi8(_mm_and_si128(v, sig_mask[i]),
+            sig_header[i]);
+      if(_mm_movemask_epi8(eq) == 0xffff)
+         return i;
+   }
+#else
+   for(; cand; cand &= cand - 1)
+   {
+      int i = __builtin_ctz(cand), j;
+      for(j = 0; j < 16 && (p[j] & sigs[i].mask[j]) == sigs[i].header[j]; j++)
+         ;
+      if(j == 16)
+         return i;
+   }
+#endif
+   return -1;
+}
+
+/*
+ * Find @f in @p.  The vector loop compares the first and last byte of the
+ * footer at 16 positions at a time and only checks the rest where both hit.
+ */
+static long find_footer(const u8 *p, long n, const u8 *f, int flen)
+{
+   long i = 0;
+
+#ifdef __SSE2__
+   __m128i first = _mm_set1_epi8(f[0]);
+   __m128i last = _mm_set1_epi8(f[flen - 1]);
+   for(; i + flen - 1 + 16 <= n; i += 16)
+   {
+      __m128i a = _mm_loadu_si128((const __m128i *)(p + i));
+      __m128i b = _mm_loadu_si128((const __m128i *)(p + i + flen - 1));
+      u32 mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first),
+               _mm_cmpeq_epi8(b, last)));
+      for(; mask; mask &= mask - 1)
+      {
+         int bit = __builtin_ctz(mask);
+         if(!memcmp(p + i + bit + 1, f + 1, flen - 2))
+            return i + bit;
+      }
+   }
+#endif
+   for(; i + flen <= n; i++)
+      if(p[i] == f[0] && !memcmp(p + i, f, flen))
+         return i;
+   return -1;
+}
+
+struct carve_job {
+   ntfs_volume      *vol;
+   s64              nr_segments;
+   s64              next_segment;	/* Taken atomically by the workers */
+};
+
+struct carve_worker {
+   struct carve_job *job;
+   pthread_t        thread;
+   u8               *bmp;		/* $Bitmap for one segment */
+   LCN              bmp_lcn;		/* First cluster it describes */
+   u8               *buf;		/* Contents of a run of free clusters */
+   LCN              buf_lcn;
+   s64              buf_clusters;
+   struct carve_hit *hits;
+   long             nr_hits;
+   long             size_hits;
+   int              err;
+};
+
+/* An open candidate, waiting for its footer */
+struct carve_open {
+   int              sig;		/* -1 if nothing is open */
+   LCN              lcn;
+   s64              size;		/* Bytes scanned so far */
+   u8               carry[8];		/* Tail of the previous cluster */
+};
+
+/*
+ * 1 if cluster @lcn is free, 0 if not, or -1 if $Bitmap could not be read.
+ * An error also sets @w->err, which ends the carve.
+ */
+static int cluster_free(struct carve_worker *w, LCN lcn)
+{
+   ntfs_volume *vol = w->job->vol;
+   LCN window = lcn & ~(LCN)(CARVE_SEGMENT - 1);
+
+   if(lcn >= vol->nr_clusters)
+      return 0;
+   if(window != w->bmp_lcn)
+   {
+      if(ntfs_rl_pread(vol, vol->lcnbmp_na->rl, window >> 3,
+               CARVE_SEGMENT >> 3, w->bmp) < 0)
+      {
+         if(!w->err)
+            fprintf(stderr, "[ERROR] Reading $Bitmap for cluster %lld "
+                  "failed\n", (long long)lcn);
+         w->err = -1;
+         return -1;
+      }
+      w->bmp_lcn = window;
+   }
+   lcn -= window;
+   return !(w->bmp[lcn >> 3] & (1 << (lcn & 7)));
+}
+
+/* Skip allocated clusters a bitmap word at a time */
+static LCN skip_allocated(struct carve_worker *w, LCN lcn)
+{
+   while(lcn < w->job->vol->nr_clusters && cluster_free(w, lcn) == 0)
+   {
+      LCN rel = lcn - w->bmp_lcn;
+      if(rel >= 0 && (rel & 63) == 0 && rel + 64 <= CARVE_SEGMENT
+            && *(u64 *)(w->bmp + (rel >> 3)) == ~0ULL)
+         lcn += 64;
+      else
+         lcn++;
+   }
+   return lcn;
+}
+
+/*
+ * Free clusters from @lcn on, up to @max, a bitmap word at a time where
+ * all of it is free.  Returns -1 if $Bitmap could not be read.
+ */
+static s64 count_free(struct carve_worker *w, LCN lcn, s64 max)
+{
+   s64 n = 0;
+   int f = 1;
+
+   while(n < max && (f = cluster_free(w, lcn + n)) > 0)
+   {
+      LCN rel = lcn + n - w->bmp_lcn;
+      if((rel & 63) == 0 && rel + 64 <= CARVE_SEGMENT && n + 64 <= max
+            && lcn + n + 64 <= w->job->vol->nr_clusters
+            && *(u64 *)(w->bmp + (rel >> 3)) == 0)
+         n += 64;
+      else
+         n++;
+   }
+   return f < 0 ? -1 : n;
+}
+
+/* Contents of free cluster @lcn, reading the free run it starts */
+static const u8 *cluster_data(struct carve_worker *w, LCN lcn)
+{
+   ntfs_volume *vol = w->job->vol;
+   s64 n = 0;
+
+   if(lcn >= w->buf_lcn && lcn < w->buf_lcn + w->buf_clusters)
+      return w->buf + ((lcn - w->buf_lcn) << vol->cluster_size_bits);
+   while(((n + 1) << vol->cluster_size_bits) <= CARVE_CHUNK
+         && cluster_free(w, lcn + n) > 0)
+      n++;
+   if(n == 0)
+      n = 1;
+   s64 len = n << vol->cluster_size_bits;
+   s64 got = ntfs_device_pread(vol->dev, lcn << vol->cluster_size_bits,
+         len, w->buf);
+   if(got < 0)
+      return NULL;
+   memset(w->buf + got, 0, len - got);
+   w->buf_lcn = lcn;
+   w->buf_clusters = n;
+   return w->buf;
+}
+
+static void emit(struct carve_worker *w, int sig, LCN lcn, s64 size,
+      int complete)
+{
+   if(w->nr_hits == w->size_hits)
+   {
+      long n = w->size_hits ? w->size_hits * 2 : 256;
+      struct carve_hit *h = realloc(w->hits, n * sizeof(*h));
+      if(h == NULL)
+      {
+         w->err = -1;
+         return;
+      }
+      w->hits = h;
+      w->size_hits = n;
+   }
+   memset(&w->hits[w->nr_hits], 0, sizeof(w->hits[0]));
+   w->hits[w->nr_hits].lcn = lcn;
+   w->hits[w->nr_hits].size = size;
+   w->hits[w->nr_hits].type = sigs[sig].type;
+   w->hits[w->nr_hits++].complete = complete;
+}
+
+static void close_open(struct carve_worker *w, struct carve_open *o)
+{
+   if(o->sig >= 0)
+      emit(w, o->sig, o->lcn, o->size, 0);
+   o->sig = -1;
+}
+
+/*
+ * Look for the footer of @o in the cluster at @c, including one that
+ * straddles the boundary with the previous cluster.  Returns 1 when the
+ * candidate was completed.
+ */
+static int scan_footer(struct carve_worker *w, struct carve_open *o,
+      const u8 *c, u32 start)
+{
+   const struct carve_sig *s = &sigs[o->sig];
+   u32 cluster_size = w->job->vol->cluster_size;
+   int keep = s->footer_len - 1;
+   long ofs;
+
+   if(o->size)
+   {
+      u8 tmp[16];
+      memcpy(tmp, o->carry, keep);
+      memcpy(tmp + keep, c, keep);
+      ofs = find_footer(tmp, 2 * keep, s->footer, s->footer_len);
+      if(ofs >= 0)
+      {
+         emit(w, o->sig, o->lcn, o->size - keep + ofs + s->footer_len
+               + s->extra, 1);
+         o->sig = -1;
+         return 1;
+      }
+   }
+   ofs = find_footer(c + start, cluster_size - start, s->footer,
+         s->footer_len);
+   if(ofs >= 0)
+   {
+      emit(w, o->sig, o->lcn, o->size + start + ofs + s->footer_len
+            + s->extra, 1);
+      o->sig = -1;
+      return 1;
+   }
+   memcpy(o->carry, c + cluster_size - keep, keep);
+   return 0;
+}
+
+/*
+ * Carve one segment.  Headers are only taken inside the segment, but a file
+ * that starts in it is followed into the next one until it ends.
+ */
+static void carve_segment(struct carve_worker *w, LCN start, LCN end)
+{
+   ntfs_volume *vol = w->job->vol;
+   struct carve_open o = { .sig = -1 };
+   LCN lcn = start;
+
+   while(lcn < vol->nr_clusters && (lcn < end || o.sig >= 0))
+   {
+      int f = cluster_free(w, lcn);
+      if(f < 0)
+         break;
+      if(f == 0)
+      {
+         close_open(w, &o);
+         lcn = skip_allocated(w, lcn);
+         continue;
+      }
+      const u8 *c = cluster_data(w, lcn);
+      if(c == NULL || w->err)
+      {
+         w->err = -1;
+         break;
+      }
+
+      int sig = match_header(c);
+      if(sig >= 0)
+      {
+         close_open(w, &o);
+         if(lcn >= end)
+            break;
+         if(sigs[sig].size)
+         {
+            s64 size = sigs[sig].size(c, vol->cluster_size);
+            if(size > 0 && size <= sigs[sig].max_size)
+            {
+               /* The header only says how large it was; what is left is
+                  what is still free */
+               s64 want = (size + vol->cluster_size - 1)
+                  >> vol->cluster_size_bits;
+               s64 n = count_free(w, lcn, want);
+               if(n < 0)
+                  break;
+               emit(w, sig, lcn, n == want ? size
+                     : n << vol->cluster_size_bits, n == want);
+               lcn += n;
+               continue;
+            }
+         }
+         o.sig = sig;
+         o.lcn = lcn;
+         o.size = 0;
+      }
+      if(o.sig >= 0)
+      {
+         const struct carve_sig *s = &sigs[o.sig];
+         if(s->footer_len == 0
+               || !scan_footer(w, &o, c, sig >= 0 ? s->header_len : 0))
+         {
+            o.size += vol->cluster_size;
+            if(o.size >= s->max_size)
+            {
+               o.size = s->max_size;
+               close_open(w, &o);
+            }
+         }
+      }
+      lcn++;
+   }
+   close_open(w, &o);
+}
+
+static void *carve_thread(void *arg)
+{
+   struct carve_worker *w = arg;
+   s64 seg;
+
+   while((seg = __atomic_fetch_add(&w->job->next_segment, 1,
+               __ATOMIC_RELAXED)) < w->job->nr_segments && !w->err)
+      carve_segment(w, seg * CARVE_SEGMENT, (seg + 1) * CARVE_SEGMENT);
+   return NULL;
+}
+
+static int hit_cmp(const void *a, const void *b)
+{
+   const struct carve_hit *x = a, *y = b;
+
+   return x->lcn < y->lcn ? -1 : x->lcn > y->lcn;
+}
+
+/**
+ * carve_ntfs - find files by content in the free clusters of @vol
+ *
+ * Only clusters $Bitmap marks free are read.  The volume is cut into
+ * segments that @nr_threads workers take in turn, each reading whole free
+ * runs at a time.  On success *@hits holds the candidates in cluster
+ * order and their number is returned, otherwise -1.
+ */
+long carve_ntfs(ntfs_volume *vol, int nr_threads, struct carve_hit **hits)
+{
+   static pthread_once_t once = PTHREAD_ONCE_INIT;
+   struct carve_job job = { vol, 0, 0 };
+   struct carve_worker *w;
+   long nr_hits = 0, i;
+   int nr_started = 0, nr_workers, err = 0;
+
+   if(load_ntfs_bitmap(vol) < 0)
+      return -1;
+   pthread_once(&once, init_sigs);
+   if(nr_threads < 1)
+      nr_threads = 1;
+   job.nr_segments = (vol->nr_clusters + CARVE_SEGMENT - 1) / CARVE_SEGMENT;
+   w = calloc(nr_threads, sizeof(*w));
+   if(w == NULL)
+      return -1;
+   for(i = 0; i < nr_threads; i++)
+   {
+      w[i].job = &job;
+      w[i].bmp_lcn = -1;
+      w[i].bmp = malloc(CARVE_SEGMENT >> 3);
+      w[i].buf = ntfs_io_buf_alloc(CARVE_CHUNK);
+      if(w[i].bmp == NULL || w[i].buf == NULL)
+         break;
+      if(pthread_create(&w[i].thread, NULL, carve_thread, &w[i]) != 0)
+      {
+         /* Carry on with the workers there are, this thread among them */
+         carve_thread(&w[i++]);
+         break;
+      }
+      nr_started++;
+   }
+   /* Without memory for any worker there is no one to do the work; the
+      workers there are take every segment between them */
+   nr_workers = i;
+   if(nr_workers == 0)
+      err = -1;
+   for(i = 0; i < nr_started; i++)
+      pthread_join(w[i].thread, NULL);
+   for(i = 0; i < nr_workers; i++)
+   {
+      err |= w[i].err;
+      nr_hits += w[i].nr_hits;
+   }
+
+   *hits = err ? NULL : malloc((nr_hits ? nr_hits : 1) * sizeof(**hits));
+   if(*hits)
+   {
+      nr_hits = 0;
+      for(i = 0; i < nr_workers; i++)
+      {
+         if(w[i].nr_hits == 0)
+            continue;
+         memcpy(*hits + nr_hits, w[i].hits, w[i].nr_hits * sizeof(**hits));
+         nr_hits += w[i].nr_hits;
+      }
+      qsort(*hits, nr_hits, sizeof(**hits), hit_cmp);
+   }
+   else
+      nr_hits = -1;
+   for(i = 0; i < nr_threads; i++)
+   {
+      free(w[i].bmp);
+      free(w[i].buf);
+      free(w[i].hits);
+   }
+   free(w);
+   return nr_hits;
+}
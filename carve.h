@@ -0,0 +1,35 @@
+/*
+ * carve.h - Content based recovery from the unallocated clusters.
+ */
+
+#ifndef _NTFS_CARVE_H
+#define _NTFS_CARVE_H
+
+#include "type.h"
+#include "hash.h"
+
+/**
+ * struct carve_hit - a candidate file found by content
+ * @lcn:	first cluster of the file (files always start on a cluster)
+ * @size:	size in bytes, counted over contiguous free clusters
+ * @type:	short name of the matching signature, also its usual extension
+ * @complete:	1 if the end was found (footer or size in the header),
+ *		0 if the file was cut short by allocated space, the next
+ *		header or the size limit of its type
+ * @digest:	hashes of the content, if it was extracted
+ * @path:	where it was extracted to
+ */
+struct carve_hit {
+	LCN lcn;
+	s64 size;
+	const char *type;
+	int complete;
+	struct stream_digest digest;
+	char *path;
+};
+
+struct _ntfs_volume;
+
+long carve_ntfs(struct _ntfs_volume *, int, struct carve_hit **);
+
+#endif /* defined _NTFS_CARVE_H */
@@ -0,0 +1,271 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+#include "ntfs_recover.h"
+#include "direct.h"
+
+/*
+ * The pool holds @depth buffers of @chunk bytes.  A reader holds one for
+ * every request it has on the device, whether or not it bounces through
+ * it, so at most @depth requests are ever in flight.
+ */
+struct ntfs_direct {
+   int             fd;
+   u32             align;		/* Device offsets and lengths */
+   size_t          chunk;
+   int             depth;
+   u8              *pool;
+   u8              **free;		/* Stack of unused pool buffers */
+   int             nr_free;
+   pthread_mutex_t lock;
+   pthread_cond_t  cond;
+   struct ntfs_direct_stats stats;	/* Under @lock */
+};
+
+/*
+ * The alignment O_DIRECT wants of file offsets: the logical block size of a
+ * block device, or what the file system reports for an image file.
+ */
+static u32 direct_align(int fd)
+{
+   struct stat st;
+   u32 align = 0;
+
+   if(fstat(fd, &st) < 0)
+      return 0;
+   if(S_ISBLK(st.st_mode))
+   {
+      int lbs;
+      if(ioctl(fd, BLKSSZGET, &lbs) == 0 && lbs > 0)
+         align = lbs;
+   }
+   else
+   {
+#if defined(STATX_DIOALIGN)
+      struct statx stx;
+      if(statx(fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx) == 0
+            && (stx.stx_mask & STATX_DIOALIGN) && stx.stx_dio_offset_align)
+         align = stx.stx_dio_offset_align;
+#endif
+      if(align == 0)
+         align = st.st_blksize;
+   }
+   if(align < 512 || (align & (align - 1)))
+      align = DIRECT_BUF_ALIGN;
+   return align;
+}
+
+/**
+ * ntfs_direct_open - open @path for reads that bypass the page cache
+ *
+ * Requests go to the device @chunk bytes at a time, at most @depth of them
+ * at once; 0 takes the defaults.  @chunk is rounded up to whole blocks.
+ * Returns NULL if @path cannot be opened with O_DIRECT, e.g. on a file
+ * system without support for it.
+ */
+struct ntfs_direct *ntfs_direct_open(const char *path, size_t chunk,
+      int depth)
+{
+   struct ntfs_direct *d = calloc(1, sizeof(struct ntfs_direct));
+
+   if(d == NULL)
+      return NULL;
+   d->fd = open(path, O_RDONLY | O_DIRECT);
+   if(d->fd < 0 || (d->align = direct_align(d->fd)) == 0)
+   {
+      if(d->fd >= 0)
+         close(d->fd);
+      free(d);
+      return NULL;
+   }
+
+   /* Whole blocks, and whole sectors whatever the volume's sector size */
+   size_t unit = d->align > DIRECT_BUF_ALIGN ? d->align : DIRECT_BUF_ALIGN;
+   if(chunk == 0)
+      chunk = DIRECT_DEFAULT_CHUNK;
+   d->chunk = (chunk + unit - 1) & ~(unit - 1);
+   d->depth = depth > 0 ? depth : DIRECT_DEFAULT_DEPTH;
+   d->free = malloc(d->depth * sizeof(*d->free));
+   if(d->free == NULL
+         || posix_memalign((void **)&d->pool, unit, d->depth * d->chunk))
+   {
+      free(d->free);
+      close(d->fd);
+      free(d);
+      return NULL;
+   }
+   for(int i = 0; i < d->depth; i++)
+      d->free[i] = d->pool + i * d->chunk;
+   d->nr_free = d->depth;
+   pthread_mutex_init(&d->lock, NULL);
+   pthread_cond_init(&d->cond, NULL);
+   d->stats.block_size = d->align;
+   d->stats.chunk = d->chunk;
+   d->stats.depth = d->depth;
+   return d;
+}
+
+void ntfs_direct_close(struct ntfs_direct *d)
+{
+   if(d == NULL)
+      return;
+   pthread_cond_destroy(&d->cond);
+   pthread_mutex_destroy(&d->lock);
+   close(d->fd);
+   free(d->pool);
+   free(d->free);
+   free(d);
+}
+
+/**
+ * ntfs_direct_set_sector_size - align requests to the volume's sectors too
+ *
+ * Called once the boot sector is read; until then the block size of the
+ * device alone decides.  Sector sizes beyond what NTFS allows are ignored.
+ */
+void ntfs_direct_set_sector_size(struct ntfs_direct *d, u32 sector_size)
+{
+   if(sector_size > d->align && sector_size <= DIRECT_BUF_ALIGN
+         && !(sector_size & (sector_size - 1)))
+   {
+      d->align = sector_size;
+      d->stats.block_size = sector_size;
+   }
+}
+
+static u8 *get_slot(struct ntfs_direct *d)
+{
+   u8 *buf;
+
+   pthread_mutex_lock(&d->lock);
+   if(d->nr_free == 0)
+   {
+      d->stats.waits++;
+      while(d->nr_free == 0)
+         pthread_cond_wait(&d->cond, &d->lock);
+   }
+   buf = d->free[--d->nr_free];
+   pthread_mutex_unlock(&d->lock);
+   return buf;
+}
+
+static void put_slot(struct ntfs_direct *d, u8 *buf, s64 got, int bounced)
+{
+   pthread_mutex_lock(&d->lock);
+   d->free[d->nr_free++] = buf;
+   d->stats.reads++;
+   d->stats.bytes += got > 0 ? got : 0;
+   d->stats.bounced += bounced;
+   pthread_cond_signal(&d->cond);
+   pthread_mutex_unlock(&d->lock);
+}
+
+/*
+ * One aligned request.  Only the end of an image file that is not a whole
+ * number of blocks long comes back short and unaligned.
+ */
+static s64 direct_read(struct ntfs_direct *d, s64 pos, s64 len, u8 *buf)
+{
+   s64 total = 0;
+
+   while(total < len)
+   {
+      ssize_t n = pread(d->fd, buf + total, len - total, pos + total);
+      if(n < 0 && errno == EINTR)
+         continue;
+      if(n < 0)
+      {
+         if(errno == EINVAL)
+            fprintf(stderr, "[ERROR] The device refused an O_DIRECT read of "
+                  "%lld bytes at %lld\n", (long long)(len - total),
+                  (long long)(pos + total));
+         return -1;
+      }
+      if(n == 0)
+         break;
+      total += n;
+      if(n & (d->align - 1))
+         break;
+   }
+   return total;
+}
+
+/**
+ * ntfs_direct_pread - read @count bytes at @pos with O_DIRECT
+ *
+ * The aligned middle of a request for an aligned buffer is read straight
+ * into it.  An unaligned head or tail, the boot sector read before the
+ * sector size is known, and buffers that are not aligned go through a pool
+ * buffer covering the whole blocks around them.  Returns the bytes read,
+ * short only at the end of the device, or -1 on error.
+ */
+s64 ntfs_direct_pread(struct ntfs_direct *d, s64 pos, s64 count, void *b)
+{
+   u8 *buf = (u8 *)b;
+   s64 total = 0;
+   u64 mask = d->align - 1;
+
+   while(total < count)
+   {
+      s64 p = pos + total, want = count - total, n, got;
+      u8 *dst = buf + total;
+      u8 *slot = get_slot(d);
+
+      if(!(((uintptr_t)dst | (u64)p) & mask) && (u64)want > mask)
+      {
+         n = want & ~(s64)mask;
+         if(n > (s64)d->chunk)
+            n = d->chunk;
+         got = direct_read(d, p, n, dst);
+         put_slot(d, slot, got, 0);
+      }
+      else
+      {
+         s64 head = p & mask;
+         n = (s64)d->chunk - head < want ? (s64)d->chunk - head : want;
+         got = direct_read(d, p - head, (head + n + mask) & ~mask, slot);
+         if(got >= 0)
+         {
+            got = got > head ? got - head : 0;
+            if(got > n)
+               got = n;
+            memcpy(dst, slot + head, got);
+         }
+         put_slot(d, slot, got, 1);
+      }
+      if(got < 0)
+         return -1;
+      total += got;
+      if(got < n)
+         break;
+   }
+   return total;
+}
+
+void ntfs_direct_get_stats(struct ntfs_direct *d, struct ntfs_direct_stats *st)
+{
+   pthread_mutex_lock(&d->lock);
+   *st = d->stats;
+   pthread_mutex_unlock(&d->lock);
+}
+
+/**
+ * ntfs_io_buf_alloc - a buffer for device reads, freed with free()
+ *
+ * Page aligned, so reads of whole blocks into it need no bounce buffer
+ * when the device is opened with O_DIRECT.
+ */
+void *ntfs_io_buf_alloc(size_t size)
+{
+   void *p;
+
+   if(posix_memalign(&p, DIRECT_BUF_ALIGN, size ? size : 1))
+      return NULL;
+   return p;
+}
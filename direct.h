@@ -0,0 +1,43 @@
+/*
+ * direct.h - Reading the device with O_DIRECT, past the page cache.
+ */
+
+#ifndef _NTFS_DIRECT_H
+#define _NTFS_DIRECT_H
+
+#include <stddef.h>
+#include "type.h"
+
+struct ntfs_direct;
+
+/* Bytes read from the device per request, unless set otherwise */
+#define DIRECT_DEFAULT_CHUNK	(1 << 20)
+
+/* Requests in flight at once, unless set otherwise */
+#define DIRECT_DEFAULT_DEPTH	8
+
+/* Alignment of the buffers ntfs_io_buf_alloc() hands out */
+#define DIRECT_BUF_ALIGN	4096
+
+/**
+ * struct ntfs_direct_stats - what the O_DIRECT reader has done
+ */
+struct ntfs_direct_stats {
+	u32 block_size;		/* Offsets and lengths are aligned to this. */
+	u32 chunk;		/* Largest single request to the device. */
+	int depth;		/* Requests that may be in flight at once. */
+	u64 reads;		/* Requests sent to the device. */
+	u64 bytes;		/* Bytes those requests read. */
+	u64 bounced;		/* Requests read through a pool buffer because
+				   the caller's range or buffer was unaligned. */
+	u64 waits;		/* Times a reader waited for a free slot. */
+};
+
+struct ntfs_direct *ntfs_direct_open(const char *, size_t, int);
+void ntfs_direct_close(struct ntfs_direct *);
+void ntfs_direct_set_sector_size(struct ntfs_direct *, u32);
+s64 ntfs_direct_pread(struct ntfs_direct *, s64, s64, void *);
+void ntfs_direct_get_stats(struct ntfs_direct *, struct ntfs_direct_stats *);
+void *ntfs_io_buf_alloc(size_t);
+
+#endif /* defined _NTFS_DIRECT_H */
@@ -0,0 +1,858 @@
+#include <string.h>
+#include <unistd.h>
+#include "ntfs_recover.h"
+#include "overlap.h"
+#include "timeline.h"
+#include "carve.h"
+#include "emit.h"
+
+#define EMIT_BATCH	4096		/* Files formatted by a worker at once */
+
+/* A buffer submitted ahead of its turn */
+struct emit_slot {
+   struct emit_buf b;
+   int             ready;
+};
+
+static const char digit_pairs[] =
+   "00010203040506070809101112131415161718192021222324252627282930313233343536"
+   "37383940414243444546474849505152535455565758596061626364656667686970717273"
+   "7475767778798081828384858687888990919293949596979899";
+
+static int buf_reserve(struct emit_buf *b, size_t n)
+{
+   if(b->len + n <= b->size)
+      return 0;
+   size_t size = b->size ? b->size : 4096;
+   while(size < b->len + n)
+      size *= 2;
+   char *p = realloc(b->buf, size);
+   if(p == NULL)
+      return -1;
+   b->buf = p;
+   b->size = size;
+   return 0;
+}
+
+static void put_raw(struct emit_buf *b, const void *p, size_t n)
+{
+   if(n == 0)
+      return;
+   if(buf_reserve(b, n) < 0)
+   {
+      b->err = -1;
+      return;
+   }
+   memcpy(b->buf + b->len, p, n);
+   b->len += n;
+}
+
+static void put_str(struct emit_buf *b, const char *s)
+{
+   put_raw(b, s, strlen(s));
+}
+
+static void put_u64(struct emit_buf *b, u64 v)
+{
+   char tmp[20], *p = tmp + sizeof(tmp);
+
+   while(v >= 100)
+   {
+      p -= 2;
+      memcpy(p, digit_pairs + (v % 100) * 2, 2);
+      v /= 100;
+   }
+   if(v >= 10)
+   {
+      p -= 2;
+      memcpy(p, digit_pairs + v * 2, 2);
+   }
+   else
+      *--p = '0' + v;
+   put_raw(b, p, tmp + sizeof(tmp) - p);
+}
+
+static void put_s64(struct emit_buf *b, s64 v)
+{
+   if(v < 0)
+   {
+      put_raw(b, "-", 1);
+      put_u64(b, -(u64)v);
+   }
+   else
+      put_u64(b, v);
+}
+
+/* UTC "YYYY-MM-DDTHH:MM:SSZ" without going through gmtime/strftime */
+static void put_time(struct emit_buf *b, time_t t)
+{
+   s64 days = t / 86400, secs = t % 86400;
+   char tmp[20];
+
+   if(secs < 0)
+   {
+      secs += 86400;
+      days--;
+   }
+   days += 719468;
+   s64 era = (days >= 0 ? days : days - 146096) / 146097;
+   u32 doe = days - era * 146097;
+   u32 yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+   u32 doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+   u32 mp = (5 * doy + 2) / 153;
+   u32 d = doy - (153 * mp + 2) / 5 + 1;
+   u32 m = mp < 10 ? mp + 3 : mp - 9;
+   s64 y = yoe + era * 400 + (m <= 2);
+
+   if(y < 0 || y > 9999)
+   {
+      put_s64(b, t);
+      return;
+   }
+   memcpy(tmp, digit_pairs + (y / 100) * 2, 2);
+   memcpy(tmp + 2, digit_pairs + (y % 100) * 2, 2);
+   tmp[4] = '-';
+   memcpy(tmp + 5, digit_pairs + m * 2, 2);
+   tmp[7] = '-';
+   memcpy(tmp + 8, digit_pairs + d * 2, 2);
+   tmp[10] = 'T';
+   memcpy(tmp + 11, digit_pairs + (secs / 3600) * 2, 2);
+   tmp[13] = ':';
+   memcpy(tmp + 14, digit_pairs + (secs / 60 % 60) * 2, 2);
+   tmp[16] = ':';
+   memcpy(tmp + 17, digit_pairs + (secs % 60) * 2, 2);
+   tmp[19] = 'Z';
+   put_raw(b, tmp, 20);
+}
+
+/* A JSON string; runs of plain characters are copied in one go */
+static void put_json_str(struct emit_buf *b, const char *s)
+{
+   static const char hex[] = "0123456789abcdef";
+   const char *run = s;
+
+   put_raw(b, "\"", 1);
+   if(s == NULL)
+      s = run = "";
+   for(; *s; s++)
+   {
+      u8 c = *s;
+      if(c >= 0x20 && c != '"' && c != '\\')
+         continue;
+      put_raw(b, run, s - run);
+      run = s + 1;
+      switch(c)
+      {
+      case '"':  put_raw(b, "\\\"", 2); break;
+      case '\\': put_raw(b, "\\\\", 2); break;
+      case '\n': put_raw(b, "\\n", 2); break;
+      case '\r': put_raw(b, "\\r", 2); break;
+      case '\t': put_raw(b, "\\t", 2); break;
+      default:
+         {
+            char u[6] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 15] };
+            put_raw(b, u, 6);
+         }
+      }
+   }
+   put_raw(b, run, s - run);
+   put_raw(b, "\"", 1);
+}
+
+/* A CSV field, quoted only when it has to be */
+static void put_csv_str(struct emit_buf *b, const char *s)
+{
+   if(s == NULL)
+      return;
+   if(s[strcspn(s, ",\"\r\n")] == '\0')
+   {
+      put_str(b, s);
+      return;
+   }
+   put_raw(b, "\"", 1);
+   for(const char *q; (q = strchr(s, '"')); s = q + 1)
+   {
+      put_raw(b, s, q - s);
+      put_raw(b, "\"\"", 2);
+   }
+   put_str(b, s);
+   put_raw(b, "\"", 1);
+}
+
+static void put_le(struct emit_buf *b, u64 v, int n)
+{
+   u8 tmp[8];
+
+   for(int i = 0; i < n; i++, v >>= 8)
+      tmp[i] = v;
+   put_raw(b, tmp, n);
+}
+
+static void put_bin_str(struct emit_buf *b, const char *s)
+{
+   size_t n = s ? strlen(s) : 0;
+
+   if(n > 0xffff)
+      n = 0xffff;
+   put_le(b, n, 2);
+   put_raw(b, s, n);
+}
+
+static void put_hex(struct emit_buf *b, const u8 *p, int n)
+{
+   static const char hex[] = "0123456789abcdef";
+
+   if(buf_reserve(b, 2 * n) < 0)
+   {
+      b->err = -1;
+      return;
+   }
+   for(int i = 0; i < n; i++)
+   {
+      b->buf[b->len++] = hex[p[i] >> 4];
+      b->buf[b->len++] = hex[p[i] & 15];
+   }
+}
+
+/* Hashes and path of an extracted stream, if it was */
+static void digest_ndjson(struct emit_buf *b, const struct stream_digest *h,
+      const char *path)
+{
+   u8 x[8];
+
+   if(h->valid)
+   {
+      for(int i = 0; i < 8; i++)
+         x[i] = h->xxh64 >> (56 - 8 * i);
+      put_str(b, ",\"sha256\":\"");
+      put_hex(b, h->sha256, SHA256_DIGEST_SIZE);
+      put_str(b, "\",\"xxh64\":\"");
+      put_hex(b, x, 8);
+      put_str(b, "\"");
+   }
+   if(path)
+   {
+      put_str(b, ",\"path\":");
+      put_json_str(b, path);
+   }
+}
+
+static void digest_csv(struct emit_buf *b, const struct stream_digest *h,
+      const char *path)
+{
+   put_raw(b, ",", 1);
+   if(h && h->valid)
+      put_hex(b, h->sha256, SHA256_DIGEST_SIZE);
+   put_raw(b, ",", 1);
+   put_csv_str(b, path);
+}
+
+/* Always 32 bytes of SHA-256 and a u64 XXH64, zero if not hashed */
+static void digest_binary(struct emit_buf *b, const struct stream_digest *h,
+      const char *path)
+{
+   static const u8 zero[SHA256_DIGEST_SIZE];
+
+   put_raw(b, h->valid ? h->sha256 : zero, SHA256_DIGEST_SIZE);
+   put_le(b, h->valid ? h->xxh64 : 0, 8);
+   put_bin_str(b, path);
+}
+
+static int runlist_len(const runlist_element *rl)
+{
+   int n = 0;
+
+   while(rl && rl[n].length)
+      n++;
+   return n;
+}
+
+static void ufile_ndjson(struct emit_buf *b, const struct ufile *file)
+{
+   struct list_head *item;
+   int first = 1;
+
+   put_str(b, "{\"inode\":");
+   put_s64(b, file->inode);
+   put_str(b, ",\"deleted\":");
+   put_str(b, file->in_use ? "false" : "true");
+   put_str(b, ",\"directory\":");
+   put_str(b, file->directory ? "true" : "false");
+   put_str(b, ",\"attr_list\":");
+   put_str(b, file->attr_list ? "true" : "false");
+   put_str(b, ",\"date\":\"");
+   put_time(b, file->date);
+   put_str(b, "\",\"size\":");
+   put_s64(b, file->max_size);
+   put_str(b, ",\"name\":");
+   put_json_str(b, file->pref_name);
+   put_str(b, ",\"parent\":");
+   put_json_str(b, file->pref_pname);
+
+   put_str(b, ",\"names\":[");
+   list_for_each(item, &file->name)
+   {
+      struct filename *f = list_entry(item, struct filename, list);
+      put_str(b, first ? "{\"name\":" : ",{\"name\":");
+      first = 0;
+      put_json_str(b, f->name);
+      put_str(b, ",\"parent_inode\":");
+      put_u64(b, MREF(f->parent_mref));
+      put_str(b, ",\"namespace\":");
+      put_u64(b, f->name_space);
+      put_str(b, ",\"size\":");
+      put_s64(b, f->size_data);
+      put_str(b, ",\"created\":\"");
+      put_time(b, f->date_c);
+      put_str(b, "\",\"altered\":\"");
+      put_time(b, f->date_a);
+      put_str(b, "\",\"changed\":\"");
+      put_time(b, f->date_m);
+      put_str(b, "\",\"read\":\"");
+      put_time(b, f->date_r);
+      put_str(b, "\"}");
+   }
+
+   put_str(b, "],\"streams\":[");
+   first = 1;
+   list_for_each(item, &file->data)
+   {
+      struct data *d = list_entry(item, struct data, list);
+      put_str(b, first ? "{\"name\":" : ",{\"name\":");
+      first = 0;
+      put_json_str(b, d->name);
+      put_str(b, ",\"resident\":");
+      put_str(b, d->resident ? "true" : "false");
+      put_str(b, ",\"compressed\":");
+      put_str(b, d->compressed ? "true" : "false");
+      put_str(b, ",\"encrypted\":");
+      put_str(b, d->encrypted ? "true" : "false");
+      put_str(b, ",\"size\":");
+      put_s64(b, d->size_data);
+      put_str(b, ",\"allocated\":");
+      put_s64(b, d->size_alloc);
+      put_str(b, ",\"initialized\":");
+      put_s64(b, d->size_init);
+      put_str(b, ",\"runs\":");
+      put_u64(b, runlist_len(d->runlist));
+      put_str(b, ",\"recoverable\":");
+      put_u64(b, d->percent);
+      put_str(b, ",\"overlaps\":[");
+      for(int i = 0; i < d->nr_overlap; i++)
+      {
+         put_str(b, i ? ",{\"inode\":" : "{\"inode\":");
+         put_s64(b, d->overlap[i].file->inode);
+         put_str(b, ",\"stream\":");
+         put_json_str(b, d->overlap[i].data->name);
+         put_str(b, ",\"deleted\":");
+         put_str(b, d->overlap[i].file->in_use ? "false" : "true");
+         put_str(b, ",\"clusters\":");
+         put_s64(b, d->overlap[i].clusters);
+         put_str(b, "}");
+      }
+      put_str(b, "]");
+      digest_ndjson(b, &d->digest, d->path);
+      put_str(b, "}");
+   }
+   put_str(b, "]}\n");
+}
+
+static void ufile_csv(struct emit_buf *b, const struct ufile *file)
+{
+   struct list_head *item;
+   const struct data *unnamed = NULL;
+   int nr_streams = 0;
+
+   list_for_each(item, &file->data)
+   {
+      const struct data *d = list_entry(item, struct data, list);
+      if(d->name == NULL && unnamed == NULL)
+         unnamed = d;
+      nr_streams++;
+   }
+   put_s64(b, file->inode);
+   put_str(b, file->in_use ? ",0," : ",1,");
+   put_str(b, file->directory ? "1," : "0,");
+   put_str(b, file->attr_list ? "1," : "0,");
+   put_time(b, file->date);
+   put_raw(b, ",", 1);
+   put_s64(b, file->max_size);
+   put_raw(b, ",", 1);
+   put_csv_str(b, file->pref_name);
+   put_raw(b, ",", 1);
+   put_csv_str(b, file->pref_pname);
+   put_raw(b, ",", 1);
+   put_u64(b, nr_streams);
+   digest_csv(b, unnamed ? &unnamed->digest : NULL,
+         unnamed ? unnamed->path : NULL);
+   put_raw(b, "\n", 1);
+}
+
+/*
+ * u32 length of the rest of the record, u64 inode, u8 flags (deleted,
+ * directory, attr_list), s64 date, s64 size, name and parent name, then
+ * the filenames and the data streams, each list preceded by a u16 count.
+ * Streams carry their hashes and extracted path, flag bit 3 says whether
+ * the hashes are set.  Strings are a u16 length followed by UTF-8 bytes.
+ */
+static void ufile_binary(struct emit_buf *b, const struct ufile *file)
+{
+   struct list_head *item;
+   size_t start = b->len;
+   int n = 0;
+
+   put_le(b, 0, 4);
+   put_le(b, file->inode, 8);
+   put_le(b, (!file->in_use) | file->directory << 1 | file->attr_list << 2, 1);
+   put_le(b, file->date, 8);
+   put_le(b, file->max_size, 8);
+   put_bin_str(b, file->pref_name);
+   put_bin_str(b, file->pref_pname);
+
+   list_for_each(item, &file->name)
+      n++;
+   put_le(b, n, 2);
+   list_for_each(item, &file->name)
+   {
+      struct filename *f = list_entry(item, struct filename, list);
+      put_le(b, f->parent_mref, 8);
+      put_le(b, f->name_space, 1);
+      put_le(b, f->size_data, 8);
+      put_le(b, f->date_c, 8);
+      put_le(b, f->date_a, 8);
+      put_le(b, f->date_m, 8);
+      put_le(b, f->date_r, 8);
+      put_bin_str(b, f->name);
+   }
+
+   n = 0;
+   list_for_each(item, &file->data)
+      n++;
+   put_le(b, n, 2);
+   list_for_each(item, &file->data)
+   {
+      struct data *d = list_entry(item, struct data, list);
+      put_le(b, d->resident | d->compressed << 1 | d->encrypted << 2
+            | d->digest.valid << 3, 1);
+      put_le(b, d->size_data, 8);
+      put_le(b, d->size_alloc, 8);
+      put_le(b, d->size_init, 8);
+      put_le(b, runlist_len(d->runlist), 4);
+      put_bin_str(b, d->name);
+      digest_binary(b, &d->digest, d->path);
+   }
+   if(b->len >= start + 4)
+   {
+      u32 len = b->len - start - 4;
+      memcpy(b->buf + start, &len, 4);
+   }
+}
+
+/**
+ * emit_ufile - format @file into @b in the format of @e
+ */
+void emit_ufile(struct emitter *e, struct emit_buf *b,
+      const struct ufile *file)
+{
+   switch(e->format)
+   {
+   case EMIT_NDJSON:
+      ufile_ndjson(b, file);
+      break;
+   case EMIT_CSV:
+      ufile_csv(b, file);
+      break;
+   case EMIT_BINARY:
+      ufile_binary(b, file);
+      break;
+   }
+}
+
+void emit_carve_hit(struct emitter *e, struct emit_buf *b,
+      const struct carve_hit *hit, u32 cluster_size)
+{
+   size_t start = b->len;
+
+   switch(e->format)
+   {
+   case EMIT_NDJSON:
+      put_str(b, "{\"lcn\":");
+      put_s64(b, hit->lcn);
+      put_str(b, ",\"offset\":");
+      put_s64(b, hit->lcn * cluster_size);
+      put_str(b, ",\"size\":");
+      put_s64(b, hit->size);
+      put_str(b, ",\"type\":");
+      put_json_str(b, hit->type);
+      put_str(b, ",\"complete\":");
+      put_str(b, hit->complete ? "true" : "false");
+      digest_ndjson(b, &hit->digest, hit->path);
+      put_str(b, "}\n");
+      break;
+   case EMIT_CSV:
+      put_s64(b, hit->lcn);
+      put_raw(b, ",", 1);
+      put_s64(b, hit->lcn * cluster_size);
+      put_raw(b, ",", 1);
+      put_s64(b, hit->size);
+      put_raw(b, ",", 1);
+      put_csv_str(b, hit->type);
+      put_str(b, hit->complete ? ",1" : ",0");
+      digest_csv(b, &hit->digest, hit->path);
+      put_raw(b, "\n", 1);
+      break;
+   case EMIT_BINARY:
+      put_le(b, 0, 4);
+      put_le(b, hit->lcn, 8);
+      put_le(b, hit->size, 8);
+      put_le(b, hit->complete | hit->digest.valid << 3, 1);
+      put_bin_str(b, hit->type);
+      digest_binary(b, &hit->digest, hit->path);
+      if(b->len >= start + 4)
+      {
+         u32 len = b->len - start - 4;
+         memcpy(b->buf + start, &len, 4);
+      }
+      break;
+   }
+}
+
+/**
+ * emit_carve_header - start a stream of carved candidates
+ *
+ * Only CSV has a header, naming the columns emit_carve_hit() fills in.
+ */
+void emit_carve_header(struct emitter *e)
+{
+   if(e->format == EMIT_CSV)
+   {
+      struct emit_buf b = { NULL, 0, 0, 0 };
+      put_str(&b, "lcn,offset,size,type,complete,sha256,path\n");
+      emit_submit(e, e->next_seq, &b);
+      free(b.buf);
+   }
+}
+
+/**
+ * emit_carve_hits - write @nr_hits carved candidates to @e
+ *
+ * The hits go to the emitter EMIT_BATCH at a time, so only one batch of
+ * them is ever formatted in memory.
+ */
+int emit_carve_hits(struct emitter *e, const struct carve_hit *hits,
+      long nr_hits, u32 cluster_size)
+{
+   struct emit_buf b = { NULL, 0, 0, 0 };
+
+   emit_carve_header(e);
+   for(long i = 0; i < nr_hits; i++)
+   {
+      emit_carve_hit(e, &b, &hits[i], cluster_size);
+      if((i + 1) % EMIT_BATCH == 0)
+         emit_submit(e, e->next_seq, &b);
+   }
+   emit_submit(e, e->next_seq, &b);
+   free(b.buf);
+   return emit_flush(e);
+}
+
+/**
+ * emit_event_header - start a stream of timeline events
+ */
+void emit_event_header(struct emitter *e)
+{
+   if(e->format == EMIT_CSV)
+   {
+      struct emit_buf b = { NULL, 0, 0, 0 };
+      put_str(&b, "time,macb,source,inode,deleted,name,parent\n");
+      emit_submit(e, e->next_seq, &b);
+      free(b.buf);
+   }
+}
+
+void emit_event(struct emitter *e, struct emit_buf *b,
+      const struct tl_event *ev, const struct ufile *file)
+{
+   const char *parent, *name = tl_event_name(ev, file, &parent);
+   size_t start = b->len;
+   char macb[5];
+
+   tl_macb(ev->macb, macb);
+   switch(e->format)
+   {
+   case EMIT_NDJSON:
+      put_str(b, "{\"time\":\"");
+      put_time(b, tl_event_time(ev));
+      put_str(b, "\",\"macb\":\"");
+      put_str(b, macb);
+      put_str(b, ev->source ? "\",\"source\":\"FN\"" :
+            "\",\"source\":\"SI\"");
+      put_str(b, ",\"inode\":");
+      put_s64(b, file->inode);
+      put_str(b, ",\"deleted\":");
+      put_str(b, file->in_use ? "false" : "true");
+      put_str(b, ",\"name\":");
+      put_json_str(b, name);
+      put_str(b, ",\"parent\":");
+      put_json_str(b, parent);
+      put_str(b, "}\n");
+      break;
+   case EMIT_CSV:
+      put_time(b, tl_event_time(ev));
+      put_raw(b, ",", 1);
+      put_str(b, macb);
+      put_str(b, ev->source ? ",FN," : ",SI,");
+      put_s64(b, file->inode);
+      put_str(b, file->in_use ? ",0," : ",1,");
+      put_csv_str(b, name);
+      put_raw(b, ",", 1);
+      put_csv_str(b, parent);
+      put_raw(b, "\n", 1);
+      break;
+   case EMIT_BINARY:
+      put_le(b, 0, 4);
+      put_le(b, tl_event_time(ev), 8);
+      put_le(b, ev->macb, 1);
+      put_le(b, ev->source, 1);
+      put_le(b, file->inode, 8);
+      put_le(b, !file->in_use, 1);
+      put_bin_str(b, name);
+      put_bin_str(b, parent);
+      if(b->len >= start + 4)
+      {
+         u32 len = b->len - start - 4;
+         memcpy(b->buf + start, &len, 4);
+      }
+      break;
+   }
+}
+
+static int write_all(int fd, const char *p, size_t n)
+{
+   while(n)
+   {
+      ssize_t w = write(fd, p, n);
+      if(w < 0)
+         return -1;
+      p += w;
+      n -= w;
+   }
+   return 0;
+}
+
+/*
+ * Append @b to the output and write it out once enough has piled up.  A
+ * buffer that could not be formatted whole stops the stream: a record cut
+ * short would leave a reader of the binary format out of step.
+ */
+static void emit_out(struct emitter *e, struct emit_buf *b)
+{
+   if(b->err && !e->err)
+   {
+      fprintf(stderr, "[ERROR] Allocating memory for the output failed\n");
+      e->err = -1;
+   }
+   if(e->err)
+      ;
+   else if(e->out.len + b->len >= EMIT_WRITE_SIZE)
+   {
+      if(write_all(e->fd, e->out.buf, e->out.len) < 0
+            || write_all(e->fd, b->buf, b->len) < 0)
+         e->err = -1;
+      e->out.len = 0;
+   }
+   else
+      put_raw(&e->out, b->buf, b->len);
+   b->len = 0;
+   b->err = 0;
+}
+
+/**
+ * emit_submit - hand a formatted buffer to the emitter
+ *
+ * Buffers are written in the order of @seq, whatever order the workers
+ * finish them in.  A buffer that is early is parked, and @b gets an empty
+ * one to carry on with; a worker too far ahead waits for the others.
+ */
+int emit_submit(struct emitter *e, u64 seq, struct emit_buf *b)
+{
+   pthread_mutex_lock(&e->lock);
+   while(seq >= e->next_seq + e->window)
+      pthread_cond_wait(&e->cond, &e->lock);
+   if(seq != e->next_seq)
+   {
+      struct emit_slot *slot = &e->pending[seq % e->window];
+      struct emit_buf tmp = slot->b;
+      slot->b = *b;
+      slot->ready = 1;
+      *b = tmp;
+      b->len = 0;
+      pthread_mutex_unlock(&e->lock);
+      return 0;
+   }
+   emit_out(e, b);
+   e->next_seq++;
+   for(;;)
+   {
+      struct emit_slot *slot = &e->pending[e->next_seq % e->window];
+      if(!slot->ready)
+         break;
+      emit_out(e, &slot->b);
+      slot->ready = 0;
+      e->next_seq++;
+   }
+   pthread_cond_broadcast(&e->cond);
+   pthread_mutex_unlock(&e->lock);
+   return e->err;
+}
+
+/**
+ * emit_open - start a record stream in @format on @fd
+ *
+ * @nr_threads is the number of workers that will submit buffers, which
+ * bounds how many of them are parked at any time.
+ */
+struct emitter *emit_open(int fd, enum emit_format format, int nr_threads)
+{
+   struct emitter *e = calloc(1, sizeof(struct emitter));
+
+   if(e == NULL)
+      return NULL;
+   e->fd = fd;
+   e->format = format;
+   e->window = 4 * (nr_threads > 0 ? nr_threads : 1);
+   e->pending = calloc(e->window, sizeof(struct emit_slot));
+   if(e->pending == NULL || buf_reserve(&e->out, EMIT_WRITE_SIZE) < 0)
+   {
+      free(e->pending);
+      free(e);
+      return NULL;
+   }
+   pthread_mutex_init(&e->lock, NULL);
+   pthread_cond_init(&e->cond, NULL);
+   if(format == EMIT_BINARY)
+   {
+      put_raw(&e->out, EMIT_BINARY_MAGIC, 4);
+      put_le(&e->out, EMIT_BINARY_VERSION, 4);
+   }
+   return e;
+}
+
+int emit_flush(struct emitter *e)
+{
+   pthread_mutex_lock(&e->lock);
+   if(write_all(e->fd, e->out.buf, e->out.len) < 0)
+      e->err = -1;
+   e->out.len = 0;
+   pthread_mutex_unlock(&e->lock);
+   return e->err;
+}
+
+int emit_close(struct emitter *e)
+{
+   int err = emit_flush(e);
+
+   for(int i = 0; i < e->window; i++)
+      free(e->pending[i].b.buf);
+   free(e->pending);
+   free(e->out.buf);
+   pthread_mutex_destroy(&e->lock);
+   pthread_cond_destroy(&e->cond);
+   free(e);
+   return err;
+}
+
+int emit_parse_format(const char *s, enum emit_format *format)
+{
+   if(!strcmp(s, "ndjson") || !strcmp(s, "json"))
+      *format = EMIT_NDJSON;
+   else if(!strcmp(s, "csv"))
+      *format = EMIT_CSV;
+   else if(!strcmp(s, "bin") || !strcmp(s, "binary"))
+      *format = EMIT_BINARY;
+   else
+      return -1;
+   return 0;
+}
+
+struct emit_job {
+   struct emitter         *e;
+   const struct mft_table *files;
+   int                    all;
+   u64                    nr_batches;
+   u64                    next_batch;	/* Taken atomically by the workers */
+   u64                    base_seq;
+};
+
+static void *emit_thread(void *arg)
+{
+   struct emit_job *job = arg;
+   struct emit_buf b = { NULL, 0, 0, 0 };
+   u64 i;
+
+   while((i = __atomic_fetch_add(&job->next_batch, 1, __ATOMIC_RELAXED))
+         < job->nr_batches)
+   {
+      long end = (i + 1) * EMIT_BATCH;
+      if(end > job->files->nr)
+         end = job->files->nr;
+      /* Batches keep being submitted after an error, the others wait
+         for them, but there is no point formatting them */
+      for(long n = i * EMIT_BATCH; n < end
+            && !__atomic_load_n(&job->e->err, __ATOMIC_RELAXED); n++)
+         if(job->all || !job->files->files[n]->in_use)
+            emit_ufile(job->e, &b, job->files->files[n]);
+      emit_submit(job->e, job->base_seq + i, &b);
+   }
+   free(b.buf);
+   return NULL;
+}
+
+/**
+ * emit_mft_header - start a stream of ufile records
+ *
+ * Only CSV has a header, naming the columns emit_ufile() fills in.
+ */
+void emit_mft_header(struct emitter *e)
+{
+   if(e->format == EMIT_CSV)
+   {
+      struct emit_buf b = { NULL, 0, 0, 0 };
+      put_str(&b, "inode,deleted,directory,attr_list,date,size,name,"
+            "parent,streams,sha256,path\n");
+      emit_submit(e, e->next_seq, &b);
+      free(b.buf);
+   }
+}
+
+/**
+ * emit_ntfs_mft - write the deleted files of @files to @e
+ * @all:	write the files still in use as well
+ *
+ * The table is cut into batches that @nr_threads workers format in
+ * parallel; the batches are written back in table order.
+ */
+int emit_ntfs_mft(struct emitter *e, const struct mft_table *files,
+      int all, int nr_threads)
+{
+   struct emit_job job = { e, files, all, 0, 0, 0 };
+   pthread_t *threads;
+   int i;
+
+   emit_mft_header(e);
+   job.nr_batches = (files->nr + EMIT_BATCH - 1) / EMIT_BATCH;
+   job.base_seq = e->next_seq;
+
+   if(nr_threads < 1)
+      nr_threads = 1;
+   threads = calloc(nr_threads, sizeof(*threads));
+   for(i = 0; threads && i < nr_threads; i++)
+      if(pthread_create(&threads[i], NULL, emit_thread, &job) != 0)
+         break;
+   if(threads == NULL || i == 0)
+      emit_thread(&job);
+   while(i-- > 0)
+      pthread_join(threads[i], NULL);
+   free(threads);
+   return emit_flush(e);
+}
@@ -0,0 +1,81 @@
+/*
+ * emit.h - Streaming output of recovered records as NDJSON, CSV or binary.
+ */
+
+#ifndef _NTFS_EMIT_H
+#define _NTFS_EMIT_H
+
+#include <stddef.h>
+#include <pthread.h>
+#include "type.h"
+
+struct ufile;
+struct mft_table;
+struct carve_hit;
+struct tl_event;
+struct emit_slot;
+
+enum emit_format {
+	EMIT_NDJSON,		/* One JSON object per line. */
+	EMIT_CSV,		/* One row per file, RFC 4180 quoting. */
+	EMIT_BINARY,		/* Length prefixed little endian records. */
+};
+
+/* Output is written in pieces this big */
+#define EMIT_WRITE_SIZE	(4 << 20)
+
+/* Magic at the start of a binary record stream, followed by a u32 version */
+#define EMIT_BINARY_MAGIC	"NTRB"
+#define EMIT_BINARY_VERSION	2
+
+/**
+ * struct emit_buf - a growable output buffer
+ *
+ * Every worker formats into a buffer of its own; finished buffers are
+ * handed to the emitter with emit_submit() and written out in order.
+ */
+struct emit_buf {
+	char *buf;
+	size_t len;
+	size_t size;
+	int err;		/* Something did not fit, @buf is not whole. */
+};
+
+/**
+ * struct emitter - an output stream
+ * @fd:		where the records go
+ * @format:	how they are written
+ * @out:	records waiting for write(2)
+ * @next_seq:	sequence number of the buffer to be written next
+ * @pending:	buffers submitted ahead of @next_seq, by sequence number
+ * @window:	how far ahead of @next_seq a buffer may be submitted
+ */
+struct emitter {
+	int fd;
+	enum emit_format format;
+	struct emit_buf out;
+	int err;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	u64 next_seq;
+	struct emit_slot *pending;
+	int window;
+};
+
+struct emitter *emit_open(int, enum emit_format, int);
+int emit_close(struct emitter *);
+int emit_flush(struct emitter *);
+int emit_submit(struct emitter *, u64, struct emit_buf *);
+void emit_mft_header(struct emitter *);
+void emit_ufile(struct emitter *, struct emit_buf *, const struct ufile *);
+void emit_carve_hit(struct emitter *, struct emit_buf *,
+		const struct carve_hit *, u32);
+void emit_carve_header(struct emitter *);
+int emit_carve_hits(struct emitter *, const struct carve_hit *, long, u32);
+int emit_ntfs_mft(struct emitter *, const struct mft_table *, int, int);
+void emit_event_header(struct emitter *);
+void emit_event(struct emitter *, struct emit_buf *, const struct tl_event *,
+		const struct ufile *);
+int emit_parse_format(const char *, enum emit_format *);
+
+#endif /* defined _NTFS_EMIT_H */
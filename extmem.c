@@ -0,0 +1,673 @@
+#include <string.h>
+#include "ntfs_recover.h"
+#include "spill.h"
+#include "emit.h"
+#include "timeline.h"
+#include "extmem.h"
+
+/*
+ * Sorts open at the same time, at most; each gets this share of the budget.
+ * A timeline takes the two of xm_names() once the files are put together.
+ */
+#define EXTMEM_SPILLS	7
+/* Formatted records handed to the emitter at once */
+#define EXTMEM_SUBMIT	(1 << 20)
+/*
+ * The budget the sorts do not get: the emitter's output, the records being
+ * formatted for it (one may run past EXTMEM_SUBMIT), a chunk of $MFT, a
+ * window of $Bitmap and the records built on the stack.
+ */
+#define EXTMEM_FIXED	(EMIT_WRITE_SIZE + 2 * EXTMEM_SUBMIT + MFT_SCAN_CHUNK \
+      + LCN_SCAN_WINDOW + 4 * SPILL_MAX_RECORD)
+
+/*
+ * What the sorts hold.  Everything is keyed by the base mft record number
+ * of the file it belongs to, except runs (keyed by lcn) and the link from
+ * a filename to its directory (keyed by the directory).
+ */
+struct xm_rec {			/* One per mft record */
+   u64    mft_no;
+   time_t date;
+   time_t date_c;		/* $STANDARD_INFORMATION times */
+   time_t date_a;
+   time_t date_m;
+   time_t date_r;
+   u8     base;
+   u8     in_use;
+   u8     directory;
+   u8     attr_list;
+};
+
+struct xm_name {		/* One per filename, followed by the name */
+   u64    parent_mref;
+   s64    size_alloc;
+   s64    size_data;
+   time_t date_c;
+   time_t date_a;
+   time_t date_m;
+   time_t date_r;
+   u32    flags;
+   u8     name_space;
+   u8     has_name;
+};
+
+struct xm_data {		/* One per data extent, then runlist and name */
+   u64    id;
+   s64    size_alloc;
+   s64    size_data;
+   s64    size_init;
+   s64    size_vcn;
+   u32    nr_runs;
+   u8     resident;
+   u8     compressed;
+   u8     encrypted;
+   u8     has_runlist;
+};
+
+struct xm_run {			/* One per run of a deleted stream */
+   u64 key;
+   u64 id;
+   s64 length;
+};
+
+struct xm_free {		/* How much of such a run is free */
+   u64 id;
+   s64 nr_free;
+   s64 total;
+};
+
+struct xm_link {		/* Filename @ordinal of @child is in the key */
+   u64 child;
+   u32 ordinal;
+};
+
+struct xm_pname {		/* Its directory's name follows */
+   u32 ordinal;
+};
+
+struct extmem {
+   ntfs_volume  *vol;
+   const char   *dir;
+   size_t       share;
+   struct spill *rec;
+   struct spill *name;
+   struct spill *data;
+   struct spill *run;
+   struct spill *free;
+   struct spill *pname;
+   struct timeline *tl;		/* Where the files go for -L */
+   u64          next_id;
+   long         nr_records;
+   long         nr_long_rl;	/* Runlists too long to keep */
+   struct xm_acc *acc;		/* Free counts of the file being rebuilt */
+   int          size_acc;
+};
+
+/* Free clusters of one stream of the file being put back together */
+struct xm_acc {
+   struct data *d;
+   u64         id;
+   s64         nr_free;
+   s64         total;
+};
+
+/* A sorted stream being merged, with its current record */
+struct xm_stream {
+   struct spill *s;
+   const u8     *p;
+   u64          key;
+   u32          len;
+};
+
+static void xm_next(struct xm_stream *st)
+{
+   st->p = spill_next(st->s, &st->key, &st->len);
+}
+
+static int spill_bad(struct spill *s)
+{
+   return s == NULL || s->err;
+}
+
+/*
+ * Sort key of the file a record belongs to: its base record number and
+ * the sequence number references to it carry, so that extension records
+ * and filenames left over from an earlier file in the record do not join
+ * the file there now.  Keys still sort in mft record order.
+ */
+static u64 xm_key(u64 mft_no, u16 seq)
+{
+   return mft_no << 16 | seq;
+}
+
+/* Sweep callback: take a parsed record apart into the sorts */
+static int xm_record(struct ufile *file, u64 base, void *arg)
+{
+   struct extmem *x = arg;
+   u64 key = base ? xm_key(MREF(base), MSEQNO(base))
+      : xm_key(file->inode, ntfs_ufile_seqno(file));
+   struct xm_rec r = { file->inode, file->date, file->date_c, file->date_a,
+      file->date_m, file->date_r, base == 0, file->in_use, file->directory,
+      file->attr_list };
+   struct list_head *item;
+   u8 buf[SPILL_MAX_RECORD];
+
+   x->nr_records++;
+   spill_add(x->rec, key, &r, sizeof(r));
+   list_for_each(item, &file->name)
+   {
+      struct filename *f = list_entry(item, struct filename, list);
+      struct xm_name n = { f->parent_mref, f->size_alloc, f->size_data,
+         f->date_c, f->date_a, f->date_m, f->date_r, f->flags,
+         f->name_space, f->name != NULL };
+      size_t len = f->name ? strlen(f->name) : 0;
+      memcpy(buf, &n, sizeof(n));
+      if(len)
+         memcpy(buf + sizeof(n), f->name, len);
+      spill_add(x->name, key, buf, sizeof(n) + len);
+   }
+   list_for_each(item, &file->data)
+   {
+      struct data *d = list_entry(item, struct data, list);
+      struct xm_data xd = { x->next_id++, d->size_alloc, d->size_data,
+         d->size_init, d->size_vcn, 0, d->resident, d->compressed,
+         d->encrypted, d->runlist != NULL };
+      /* The Unicode name, it is what tells extents of a stream together */
+      size_t len = d->uname_len * sizeof(ntfschar);
+      runlist_element *rl;
+      for(rl = d->runlist; rl && rl->length; rl++)
+         xd.nr_runs++;
+      if(d->runlist && sizeof(xd) + (xd.nr_runs + 1) * sizeof(*rl) + len
+            > SPILL_MAX_RECORD)
+      {
+         x->nr_long_rl++;
+         xd.nr_runs = 0;
+         xd.has_runlist = 0;
+      }
+      memcpy(buf, &xd, sizeof(xd));
+      if(xd.has_runlist)
+         memcpy(buf + sizeof(xd), d->runlist, (xd.nr_runs + 1) * sizeof(*rl));
+      if(len)
+         memcpy(buf + sizeof(xd) + xd.has_runlist * (xd.nr_runs + 1)
+               * sizeof(*rl), d->uname, len);
+      spill_add(x->data, key, buf, sizeof(xd) + len
+            + xd.has_runlist * (xd.nr_runs + 1) * sizeof(*rl));
+
+      if(file->in_use || d->resident)
+         continue;
+      for(rl = d->runlist; rl && rl->length; rl++)
+         if(rl->lcn >= 0)
+         {
+            struct xm_run run = { key, xd.id, rl->length };
+            spill_add(x->run, rl->lcn, &run, sizeof(run));
+         }
+   }
+   free_ufile(file);
+   return x->rec->err || x->name->err || x->data->err || x->run->err;
+}
+
+/**
+ * xm_score - count the free clusters of every deleted stream
+ *
+ * Runs come out of their sort in cluster order, so $Bitmap is read once,
+ * front to back.  The counts go to @x->free, by file.
+ */
+static int xm_score(struct extmem *x)
+{
+   struct lcn_scan sc;
+   const u8 *p;
+   u64 lcn;
+   u32 len;
+
+   if(spill_sort(x->run) < 0)
+      return -1;
+   if(x->run->nr_records && ntfs_lcn_scan_init(&sc, x->vol) < 0)
+      return -1;
+   while((p = spill_next(x->run, &lcn, &len)))
+   {
+      struct xm_run r;
+      memcpy(&r, p, sizeof(r));
+      s64 n = ntfs_lcn_count_free(&sc, lcn, r.length);
+      if(n < 0)
+      {
+         x->run->err = -1;
+         break;
+      }
+      struct xm_free f = { r.id, n, r.length };
+      spill_add(x->free, r.key, &f, sizeof(f));
+   }
+   if(x->run->nr_records)
+      ntfs_lcn_scan_free(&sc);
+   if(x->run->err)
+      return -1;
+   spill_close(x->run);
+   x->run = NULL;
+   return spill_sort(x->free);
+}
+
+/**
+ * xm_names - find the name of every filename's directory
+ *
+ * One pass over the filenames in file order picks each file's preferred
+ * name (the same choice resolve_names() makes) and notes which directory
+ * each filename is in.  Sorting those links by directory and merging them
+ * with the preferred names gives the directory names, which are sorted
+ * back by file into @x->pname.
+ */
+static int xm_names(struct extmem *x)
+{
+   struct spill *pref = spill_open(x->dir, x->share);
+   struct spill *link = spill_open(x->dir, x->share);
+   u8 best[SPILL_MAX_RECORD], buf[SPILL_MAX_RECORD];
+   u64 key, cur = 0, pkey = 0;
+   u32 len, plen = 0, ordinal = 0, best_len = 0;
+   int first = 1, chosen = 0, have = 0, best_dos = 0, err = -1;
+   const u8 *p, *pp;
+
+   if(pref == NULL || link == NULL || spill_sort(x->name) < 0)
+      goto out;
+   while((p = spill_next(x->name, &key, &len)))
+   {
+      struct xm_name n;
+      memcpy(&n, p, sizeof(n));
+      if(key != cur || first)
+      {
+         if(have)
+            spill_add(pref, cur, best, best_len);
+         first = 0;
+         cur = key;
+         ordinal = 0;
+         chosen = 0;
+         have = 0;
+      }
+      struct xm_link l = { key, ordinal++ };
+      spill_add(link, xm_key(MREF(n.parent_mref), MSEQNO(n.parent_mref)),
+            &l, sizeof(l));
+      if(!chosen || best_dos)
+      {
+         /* A file whose preferred name is unusable gets no entry */
+         chosen = 1;
+         have = n.has_name;
+         best_dos = n.name_space == FILE_NAME_DOS;
+         best_len = len - sizeof(n);
+         memcpy(best, p + sizeof(n), best_len);
+      }
+   }
+   if(have)
+      spill_add(pref, cur, best, best_len);
+   if(spill_bad(x->name) || spill_rewind(x->name) < 0
+         || spill_sort(pref) < 0 || spill_sort(link) < 0)
+      goto out;
+
+   pp = spill_next(pref, &pkey, &plen);
+   while((p = spill_next(link, &key, &len)))
+   {
+      while(pp && pkey < key)
+         pp = spill_next(pref, &pkey, &plen);
+      if(pp == NULL)
+         break;
+      if(pkey != key)
+         continue;
+      struct xm_link l;
+      memcpy(&l, p, sizeof(l));
+      struct xm_pname pn = { l.ordinal };
+      memcpy(buf, &pn, sizeof(pn));
+      memcpy(buf + sizeof(pn), pp, plen);
+      spill_add(x->pname, l.child, buf, sizeof(pn) + plen);
+   }
+   if(!spill_bad(pref) && !spill_bad(link))
+      err = spill_sort(x->pname);
+out:
+   spill_close(pref);
+   spill_close(link);
+   return err;
+}
+
+static char *xm_strdup(const u8 *p, size_t len)
+{
+   char *s = malloc(len + 1);
+
+   if(s)
+   {
+      memcpy(s, p, len);
+      s[len] = '\0';
+   }
+   return s;
+}
+
+/**
+ * xm_file - put one file back together from the sorted streams
+ * @st:		records, filenames, directory names, streams and free counts
+ */
+static struct ufile *xm_file(struct extmem *x, struct xm_stream *st,
+      u64 key)
+{
+   struct ufile *file = alloc_ufile(key >> 16);
+   struct filename *pref = NULL;
+   struct list_head *item;
+   int base = 0, nr_ext = 0, nr_acc = 0, i;
+
+   if(file == NULL)
+      return NULL;
+   for(; st[0].p && st[0].key == key; xm_next(&st[0]))
+   {
+      struct xm_rec r;
+      memcpy(&r, st[0].p, sizeof(r));
+      if(r.base || !base)
+      {
+         /* An extension record without its base stands on its own */
+         file->inode = r.mft_no;
+         file->in_use = r.in_use;
+         file->directory = r.directory;
+         file->date = r.date;
+         file->date_c = r.date_c;
+         file->date_a = r.date_a;
+         file->date_m = r.date_m;
+         file->date_r = r.date_r;
+         base = r.base;
+      }
+      file->attr_list |= r.attr_list;
+      nr_ext += !r.base;
+   }
+   /* As in join_extents(), a file with extensions or an orphan is marked
+      as one of many */
+   if(!base || nr_ext)
+      file->attr_list = 1;
+
+   for(; st[1].p && st[1].key == key; xm_next(&st[1]))
+   {
+      struct filename *f = calloc(1, sizeof(*f));
+      struct xm_name n;
+      if(f == NULL)
+         continue;
+      memcpy(&n, st[1].p, sizeof(n));
+      f->parent_mref = n.parent_mref;
+      f->size_alloc = n.size_alloc;
+      f->size_data = n.size_data;
+      f->date_c = n.date_c;
+      f->date_a = n.date_a;
+      f->date_m = n.date_m;
+      f->date_r = n.date_r;
+      f->flags = n.flags;
+      f->name_space = n.name_space;
+      if(n.has_name)
+         f->name = xm_strdup(st[1].p + sizeof(n), st[1].len - sizeof(n));
+      if(f->size_data > file->max_size)
+         file->max_size = f->size_data;
+      list_add_tail(&f->list, &file->name);
+      if(pref == NULL || pref->name_space == FILE_NAME_DOS)
+         pref = f;
+   }
+   file->pref_name = pref ? pref->name : NULL;
+
+   for(; st[2].p && st[2].key == key; xm_next(&st[2]))
+   {
+      struct xm_pname pn;
+      u32 ordinal = 0;
+      memcpy(&pn, st[2].p, sizeof(pn));
+      list_for_each(item, &file->name)
+      {
+         struct filename *f = list_entry(item, struct filename, list);
+         if(ordinal++ != pn.ordinal || f->parent_name)
+            continue;
+         f->parent_name = xm_strdup(st[2].p + sizeof(pn),
+               st[2].len - sizeof(pn));
+         if(f == pref)
+            file->pref_pname = f->parent_name;
+      }
+   }
+
+   for(; st[3].p && st[3].key == key; xm_next(&st[3]))
+   {
+      struct data *d = calloc(1, sizeof(*d));
+      struct xm_data xd;
+      size_t rl_size;
+      if(d == NULL)
+         continue;
+      memcpy(&xd, st[3].p, sizeof(xd));
+      rl_size = xd.has_runlist * (xd.nr_runs + 1) * sizeof(runlist_element);
+      d->size_alloc = xd.size_alloc;
+      d->size_data = xd.size_data;
+      d->size_init = xd.size_init;
+      d->size_vcn = xd.size_vcn;
+      d->resident = xd.resident;
+      d->compressed = xd.compressed;
+      d->encrypted = xd.encrypted;
+      d->percent = xd.resident ? 100 : 0;
+      if(rl_size && (d->runlist = malloc(rl_size)))
+         memcpy(d->runlist, st[3].p + sizeof(xd), rl_size);
+      d->uname_len = (st[3].len - sizeof(xd) - rl_size) / sizeof(ntfschar);
+      if(d->uname_len && (d->uname = malloc(d->uname_len * sizeof(ntfschar))))
+      {
+         memcpy(d->uname, st[3].p + sizeof(xd) + rl_size,
+               d->uname_len * sizeof(ntfschar));
+         if(ntfs_ucstombs(d->uname, d->uname_len, &d->name) < 0)
+            d->name = NULL;
+      }
+      else
+         d->uname_len = 0;
+      if(d->size_data > file->max_size)
+         file->max_size = d->size_data;
+      /* Extents from extension records join their stream like in memory */
+      struct data *s = ntfs_join_stream(file, d);
+      if(s == NULL)
+      {
+         free(d->uname);
+         free(d->name);
+         free(d->runlist);
+         free(d);
+         continue;
+      }
+      d = s;
+
+      if(nr_acc == x->size_acc)
+      {
+         int n = x->size_acc ? x->size_acc * 2 : 16;
+         struct xm_acc *a = realloc(x->acc, n * sizeof(*a));
+         if(a == NULL)
+            continue;
+         x->acc = a;
+         x->size_acc = n;
+      }
+      x->acc[nr_acc].d = d;
+      x->acc[nr_acc].id = xd.id;
+      x->acc[nr_acc].nr_free = 0;
+      x->acc[nr_acc++].total = 0;
+   }
+
+   /* Same as score_ntfs_mft(), from the counts xm_score() made */
+   for(; st[4].p && st[4].key == key; xm_next(&st[4]))
+   {
+      struct xm_free f;
+      memcpy(&f, st[4].p, sizeof(f));
+      for(i = 0; i < nr_acc && x->acc[i].id != f.id; i++)
+         ;
+      if(i == nr_acc)
+         continue;
+      x->acc[i].nr_free += f.nr_free;
+      x->acc[i].total += f.total;
+   }
+   for(i = 0; !file->in_use && i < nr_acc; i++)
+   {
+      struct data *d = x->acc[i].d;
+      s64 nr_free = 0, total = 0;
+      int j;
+      for(j = 0; j < i && x->acc[j].d != d; j++)
+         ;
+      if(j < i || d->resident || d->runlist == NULL)
+         continue;
+      /* Extents joined into one stream count together */
+      for(j = i; j < nr_acc; j++)
+         if(x->acc[j].d == d)
+         {
+            nr_free += x->acc[j].nr_free;
+            total += x->acc[j].total;
+         }
+      d->percent = total ? nr_free * 100 / total : 100;
+   }
+   return file;
+}
+
+/**
+ * xm_output - merge the sorted streams into files, in mft record order
+ *
+ * Only one file is in memory at a time.  The deleted files, and with @all
+ * those in use as well, go to @e if there is one or are listed otherwise;
+ * with a timeline, all of them go to it instead.
+ */
+static long xm_output(struct extmem *x, struct emitter *e, int all)
+{
+   struct xm_stream st[5] = {
+      { x->rec, NULL, 0, 0 }, { x->name, NULL, 0, 0 },
+      { x->pname, NULL, 0, 0 }, { x->data, NULL, 0, 0 },
+      { x->free, NULL, 0, 0 },
+   };
+   struct emit_buf b = { NULL, 0, 0, 0 };
+   long nr_files = 0;
+   int i, err = 0;
+
+   if(spill_sort(x->rec) < 0 || spill_sort(x->data) < 0)
+      return -1;
+   for(i = 0; i < 5; i++)
+      xm_next(&st[i]);
+   if(x->tl)
+      ;
+   else if(e)
+      emit_mft_header(e);
+   else
+      list_ntfs_header();
+   for(;;)
+   {
+      u64 key = ~0ULL;
+      for(i = 0; i < 5; i++)
+         if(st[i].p && st[i].key < key)
+            key = st[i].key;
+      if(key == ~0ULL)
+         break;
+      struct ufile *file = xm_file(x, st, key);
+      if(file == NULL)
+         break;
+      nr_files++;
+      if(x->tl)
+         err = timeline_add(x->tl, file);
+      else if(file->in_use && !all)
+         ;
+      else if(e)
+      {
+         emit_ufile(e, &b, file);
+         if(b.len >= EXTMEM_SUBMIT)
+            emit_submit(e, e->next_seq, &b);
+      }
+      else
+         list_ntfs_file(file);
+      free_ufile(file);
+      if(err < 0)
+         break;
+   }
+   if(e && !x->tl)
+   {
+      emit_submit(e, e->next_seq, &b);
+      free(b.buf);
+   }
+   for(i = 0; i < 5; i++)
+      if(spill_bad(st[i].s))
+         return -1;
+   return err < 0 ? -1 : nr_files;
+}
+
+static u64 spill_runs(struct spill *s)
+{
+   return s ? s->nr_runs : 0;
+}
+
+/**
+ * extmem_ntfs_mft - list the mft within @budget bytes of memory
+ * @dir:	where the sorted runs go when memory runs out
+ * @e:		where the files go, NULL to list them
+ * @flags:	EXTMEM_ALL for the files in use too, not only the deleted
+ *		ones, EXTMEM_TIMELINE for the timeline of all of them instead
+ *
+ * The bounded version of load_ntfs_mft() and what follows it.  $MFT is
+ * swept once and every record taken apart into sorts by file (records,
+ * filenames, streams) and by cluster (runs of deleted streams).  The
+ * scores come from merging the runs with $Bitmap, the directory names
+ * from merging the filenames with the preferred names, and the files are
+ * put back together one at a time by a final merge of everything by
+ * file.  Each sort holds at most a share of @budget in memory and spills
+ * sorted runs to @dir beyond that, so the disk sees sequential writes and
+ * reads.  @budget must be at least EXTMEM_MIN_BUDGET; the cache is not
+ * part of it.  Extension records whose base record is gone come out under
+ * the number of that base record rather than their own.  A timeline is
+ * built from the files as they are put back together, see timeline_open():
+ * its events are radix sorted a run at a time and the runs merged.
+ * Returns the number of files or -1 on error.
+ */
+long extmem_ntfs_mft(ntfs_volume *vol, size_t budget, const char *dir,
+      struct emitter *e, int flags, int nr_threads)
+{
+   struct extmem x = { vol, dir, 0, NULL, NULL, NULL, NULL, NULL, NULL,
+      NULL, 0, 0, 0, NULL, 0 };
+   long nr_files = -1, nr_bad;
+
+   if(budget < EXTMEM_MIN_BUDGET)
+   {
+      fprintf(stderr, "[ERROR] A memory budget of %zu MiB is too small, "
+            "%d MiB is the least\n", budget >> 20, EXTMEM_MIN_BUDGET >> 20);
+      return -1;
+   }
+   x.share = (budget - EXTMEM_FIXED) / EXTMEM_SPILLS;
+   x.rec = spill_open(dir, x.share);
+   x.name = spill_open(dir, x.share);
+   x.data = spill_open(dir, x.share);
+   x.run = spill_open(dir, x.share);
+   x.free = spill_open(dir, x.share);
+   x.pname = spill_open(dir, x.share);
+   if(x.rec == NULL || x.name == NULL || x.data == NULL || x.run == NULL
+         || x.free == NULL || x.pname == NULL)
+      goto out;
+
+   nr_bad = ntfs_mft_sweep(vol, xm_record, &x);
+   if(nr_bad < 0 || spill_bad(x.rec) || spill_bad(x.name)
+         || spill_bad(x.data) || spill_bad(x.run))
+      goto out;
+   if(x.nr_long_rl)
+      fprintf(stderr, "[WARN] %ld runlists were too long to keep\n",
+            x.nr_long_rl);
+
+   printf("MFT SCAN INFO\n");
+   printf("--------------------------------------------\n");
+   printf(" [INFO] MFT records: %lld\n",
+         (long long)(vol->mft_na->initialized_size
+            >> vol->mft_record_size_bits));
+   printf(" [INFO] Records parsed: %ld\n", x.nr_records);
+   printf(" [INFO] Memory budget: %zu MiB, %zu MiB per sort\n",
+         budget >> 20, x.share >> 20);
+   printf(" [INFO] Sorted runs written: %llu\n",
+         (unsigned long long)(spill_runs(x.rec) + spill_runs(x.name)
+            + spill_runs(x.data) + spill_runs(x.run)));
+   printf("\n");
+
+   if(xm_score(&x) < 0 || xm_names(&x) < 0)
+      goto out;
+   if((flags & EXTMEM_TIMELINE)
+         && (x.tl = timeline_open(dir, 2 * x.share, e, nr_threads)) == NULL)
+      goto out;
+   nr_files = xm_output(&x, e, flags & EXTMEM_ALL);
+   if(x.tl && nr_files >= 0 && timeline_write(x.tl) < 0)
+      nr_files = -1;
+   if(e && emit_flush(e) < 0)
+      nr_files = -1;
+out:
+   if(nr_files < 0)
+      fprintf(stderr, "[ERROR] Listing the MFT within the memory budget "
+            "failed\n");
+   spill_close(x.rec);
+   spill_close(x.name);
+   spill_close(x.data);
+   spill_close(x.run);
+   spill_close(x.free);
+   spill_close(x.pname);
+   timeline_close(x.tl);
+   free(x.acc);
+   return nr_files;
+}
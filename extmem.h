@@ -0,0 +1,27 @@
+/*
+ * extmem.h - Listing the MFT within a fixed memory budget.
+ */
+
+#ifndef _NTFS_EXTMEM_H
+#define _NTFS_EXTMEM_H
+
+#include <stddef.h>
+#include "type.h"
+
+struct _ntfs_volume;
+struct emitter;
+
+/*
+ * Smallest budget extmem_ntfs_mft() takes.  About 7 MiB of it go to buffers
+ * of fixed size, the rest is shared by the sorts.
+ */
+#define EXTMEM_MIN_BUDGET	(16 << 20)
+
+/* What extmem_ntfs_mft() writes out */
+#define EXTMEM_ALL		0x01	/* Files in use as well */
+#define EXTMEM_TIMELINE		0x02	/* The timeline of all files */
+
+long extmem_ntfs_mft(struct _ntfs_volume *, size_t, const char *,
+		struct emitter *, int, int);
+
+#endif /* defined _NTFS_EXTMEM_H */
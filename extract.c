@@ -0,0 +1,529 @@
+#include <pthread.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "ntfs_recover.h"
+#include "carve.h"
+#include "direct.h"
+#include "extract.h"
+
+#define EXTRACT_CHUNK	(1 << 20)	/* Bytes read, hashed and written at once */
+#define EXTRACT_HASH_BITS	12	/* log2 of the buckets of the dedupe table */
+
+/**
+ * struct extract_item - a stream to be written out
+ * @rl:		runs of a non-resident stream
+ * @resident:	or the value of a resident one
+ * @size:	bytes to write
+ * @size_init:	bytes past this are zeroes whatever is on disk
+ * @name:	file name under the output directory
+ * @digest:	where the hashes go
+ * @path:	where the path of the written (or identical) file goes
+ * @carve_rl:	runlist of a carved extent, @rl points here
+ */
+struct extract_item {
+   const runlist_element *rl;
+   const void           *resident;
+   s64                  size;
+   s64                  size_init;
+   char                 *name;
+   struct stream_digest *digest;
+   char                 **path;
+   runlist_element      carve_rl[2];
+};
+
+/* A stream written out already, for finding later copies of it */
+struct extract_seen {
+   struct extract_seen  *next;
+   s64                  size;
+   struct stream_digest digest;
+   const char           *path;
+};
+
+struct extract_job {
+   ntfs_volume          *vol;
+   const char           *dir;
+   struct extract_item  *items;
+   long                 nr_items;
+   long                 next_item;
+   pthread_mutex_t      lock;
+   struct extract_seen  *seen[1 << EXTRACT_HASH_BITS];
+   long                 nr_written;	/* Counters below under @lock */
+   long                 nr_dup;
+   long                 nr_failed;
+   u64                  bytes;
+};
+
+static int write_all(int fd, const u8 *p, s64 n)
+{
+   while(n > 0)
+   {
+      ssize_t done = write(fd, p, n);
+      if(done < 0 && errno == EINTR)
+         continue;
+      if(done <= 0)
+         return -1;
+      p += done;
+      n -= done;
+   }
+   return 0;
+}
+
+static int read_item(ntfs_volume *vol, const struct extract_item *it,
+      s64 pos, s64 count, u8 *buf)
+{
+   if(it->resident)
+      memcpy(buf, (const u8 *)it->resident + pos, count);
+   else if(ntfs_rl_pread(vol, it->rl, pos, count, buf) != count)
+      return -1;
+   if(pos + count > it->size_init)
+   {
+      s64 from = it->size_init > pos ? it->size_init - pos : 0;
+      memset(buf + from, 0, count - from);
+   }
+   return 0;
+}
+
+/*
+ * Tell the kernel which clusters the next chunk lives in, so that they are
+ * on their way while the current chunk is hashed and written.
+ */
+static void prefetch_item(ntfs_volume *vol, const struct extract_item *it,
+      s64 pos, s64 count)
+{
+   int fd = fileno(vol->dev->d_fp);
+   const runlist_element *rl;
+
+   /* O_DIRECT reads would not find what this puts in the page cache */
+   if(vol->dev->d_direct)
+      return;
+   for(rl = it->rl; rl && rl->length && count > 0; rl++)
+   {
+      s64 start = rl->vcn << vol->cluster_size_bits;
+      s64 end = (rl->vcn + rl->length) << vol->cluster_size_bits;
+      if(end <= pos || rl->lcn < 0)
+         continue;
+      if(start >= pos + count)
+         break;
+      s64 from = pos > start ? pos : start;
+      s64 to = pos + count < end ? pos + count : end;
+      posix_fadvise(fd, (rl->lcn << vol->cluster_size_bits) + from - start,
+            to - from, POSIX_FADV_WILLNEED);
+   }
+}
+
+/**
+ * find_seen - look @it up among the streams written so far
+ *
+ * Candidates are found by XXH64 and size, SHA-256 decides.  Returns the
+ * path of an identical stream or NULL.
+ */
+static const char *find_seen(struct extract_job *job,
+      const struct extract_item *it)
+{
+   struct extract_seen *s;
+
+   s = job->seen[it->digest->xxh64 & ((1 << EXTRACT_HASH_BITS) - 1)];
+   for(; s; s = s->next)
+      if(s->size == it->size && s->digest.xxh64 == it->digest->xxh64
+            && !memcmp(s->digest.sha256, it->digest->sha256,
+               SHA256_DIGEST_SIZE))
+         return s->path;
+   return NULL;
+}
+
+/* Record @it, now written to @path, for find_seen() */
+static void add_seen(struct extract_job *job, const struct extract_item *it,
+      const char *path)
+{
+   struct extract_seen **head, *s = malloc(sizeof(*s));
+
+   if(s == NULL)
+      return;
+   head = &job->seen[it->digest->xxh64 & ((1 << EXTRACT_HASH_BITS) - 1)];
+   s->size = it->size;
+   s->digest = *it->digest;
+   s->path = path;
+   s->next = *head;
+   *head = s;
+}
+
+/**
+ * extract_item - read, hash and write one stream
+ *
+ * A stream that fits in a single chunk is only written once it is known
+ * to be new.  Longer ones are hashed as they are written to a ".part"
+ * file, which is renamed into place or, for a copy, removed at the end.
+ * A stream is only offered to later copies once it is in place; two
+ * copies finishing at the same time are both written, and the later one
+ * removed again.
+ */
+static int extract_item(struct extract_job *job, struct extract_item *it,
+      u8 *buf)
+{
+   size_t len = strlen(job->dir) + strlen(it->name) + 2;
+   char *path = malloc(len), *part = malloc(len + 5);
+   struct sha256_ctx sha;
+   struct xxh64_ctx xxh;
+   const char *dup;
+   s64 pos, n = 0;
+   int fd = -1;
+
+   if(path == NULL || part == NULL)
+      goto fail;
+   sprintf(path, "%s/%s", job->dir, it->name);
+   sprintf(part, "%s.part", path);
+   sha256_init(&sha);
+   xxh64_init(&xxh, 0);
+   for(pos = 0; pos < it->size; pos += n)
+   {
+      n = it->size - pos < EXTRACT_CHUNK ? it->size - pos : EXTRACT_CHUNK;
+      if(read_item(job->vol, it, pos, n, buf) < 0)
+         goto fail;
+      if(pos + n < it->size)
+         prefetch_item(job->vol, it, pos + n, EXTRACT_CHUNK);
+      sha256_update(&sha, buf, n);
+      xxh64_update(&xxh, buf, n);
+      if(n == it->size)
+         break;
+      if(fd < 0 && (fd = open(part, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+         goto fail;
+      if(write_all(fd, buf, n) < 0)
+         goto fail;
+   }
+   sha256_final(&sha, it->digest->sha256);
+   it->digest->xxh64 = xxh64_final(&xxh);
+   it->digest->valid = 1;
+
+   pthread_mutex_lock(&job->lock);
+   dup = find_seen(job, it);
+   pthread_mutex_unlock(&job->lock);
+
+   if(dup)
+   {
+      if(fd >= 0)
+      {
+         close(fd);
+         fd = -1;
+         unlink(part);
+      }
+   }
+   else
+   {
+      /* What was written, and is removed again if it is not complete */
+      const char *written = fd < 0 ? path : part;
+      int err = 0;
+      if(fd < 0)
+      {
+         fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+         if(fd < 0)
+            goto fail;
+         err = write_all(fd, buf, it->size);
+      }
+      if(close(fd) < 0)
+         err = -1;
+      fd = -1;
+      if(err < 0 || (written == part && rename(part, path) < 0))
+      {
+         unlink(written);
+         goto fail;
+      }
+   }
+   free(part);
+
+   pthread_mutex_lock(&job->lock);
+   if(dup == NULL && (dup = find_seen(job, it)))
+      unlink(path);
+   if(dup)
+   {
+      *it->path = strdup(dup);
+      job->nr_dup++;
+      free(path);
+   }
+   else
+   {
+      add_seen(job, it, path);
+      *it->path = path;
+      job->nr_written++;
+      job->bytes += it->size;
+   }
+   pthread_mutex_unlock(&job->lock);
+   return 0;
+
+fail:
+   fprintf(stderr, "[ERROR] Extracting %s failed\n", it->name);
+   if(fd >= 0)
+   {
+      close(fd);
+      unlink(part);
+   }
+   free(path);
+   free(part);
+   pthread_mutex_lock(&job->lock);
+   job->nr_failed++;
+   pthread_mutex_unlock(&job->lock);
+   return -1;
+}
+
+static void *extract_thread(void *arg)
+{
+   struct extract_job *job = arg;
+   u8 *buf = ntfs_io_buf_alloc(EXTRACT_CHUNK);
+   long i;
+
+   while((i = __atomic_fetch_add(&job->next_item, 1, __ATOMIC_RELAXED))
+         < job->nr_items)
+   {
+      if(buf == NULL)
+      {
+         pthread_mutex_lock(&job->lock);
+         job->nr_failed++;
+         pthread_mutex_unlock(&job->lock);
+         continue;
+      }
+      extract_item(job, &job->items[i], buf);
+   }
+   free(buf);
+   return NULL;
+}
+
+/**
+ * extract_run - write out the streams of @job on @nr_threads workers
+ *
+ * Every worker takes one stream at a time, so a stream is read, hashed
+ * and written in order while other streams go through the other workers.
+ */
+static int extract_run(struct extract_job *job, int nr_threads,
+      long nr_skipped)
+{
+   pthread_t *threads;
+   long i;
+   int n;
+
+   if(mkdir(job->dir, 0755) < 0 && errno != EEXIST)
+   {
+      fprintf(stderr, "[ERROR] Creating %s failed\n", job->dir);
+      return -1;
+   }
+   pthread_mutex_init(&job->lock, NULL);
+   if(nr_threads < 1)
+      nr_threads = 1;
+   threads = calloc(nr_threads, sizeof(*threads));
+   for(n = 0; threads && n < nr_threads; n++)
+      if(pthread_create(&threads[n], NULL, extract_thread, job) != 0)
+         break;
+   if(threads == NULL || n == 0)
+      extract_thread(job);
+   while(n-- > 0)
+      pthread_join(threads[n], NULL);
+   free(threads);
+   pthread_mutex_destroy(&job->lock);
+
+   for(i = 0; i < (1 << EXTRACT_HASH_BITS); i++)
+      while(job->seen[i])
+      {
+         struct extract_seen *s = job->seen[i];
+         job->seen[i] = s->next;
+         free(s);
+      }
+   for(i = 0; i < job->nr_items; i++)
+      free(job->items[i].name);
+
+   printf("EXTRACT INFO\n");
+   printf("--------------------------------------------\n");
+   printf(" [INFO] Output directory: %s\n", job->dir);
+   printf(" [INFO] Streams: %ld\n", job->nr_items);
+   printf(" [INFO] Written: %ld (%llu bytes)\n", job->nr_written,
+         (unsigned long long)job->bytes);
+   printf(" [INFO] Duplicates: %ld\n", job->nr_dup);
+   printf(" [INFO] Skipped: %ld\n", nr_skipped);
+   printf(" [INFO] Failed: %ld\n", job->nr_failed);
+   printf(" [INFO] SHA-256: %s\n", sha256_impl());
+   printf("\n");
+   return job->nr_failed ? -1 : 0;
+}
+
+/*
+ * Append the first @n bytes of @s to @out, with anything that cannot be in
+ * a file name replaced
+ */
+static char *name_append(char *out, const char *s, size_t n)
+{
+   for(; n--; s++)
+      *out++ = (*s == '/' || (u8)*s < 0x20) ? '_' : *s;
+   return out;
+}
+
+/* How much of @s fits in @max bytes without cutting a UTF-8 sequence */
+static size_t utf8_fit(const char *s, size_t max)
+{
+   size_t len = strlen(s);
+
+   if(len <= max)
+      return len;
+   while(max > 0 && ((u8)s[max] & 0xc0) == 0x80)
+      max--;
+   return max;
+}
+
+/*
+ * "<inode>_<name>" for the unnamed stream that comes first in the file,
+ * "<inode>-<nr>_<name>_<stream>" for stream @nr otherwise, cut down so
+ * that it still fits NAME_MAX with the ".part" of a file being written.
+ * The stream name keeps at most half of the room when both are too long.
+ * What comes before the first '_' is different for every stream, so no
+ * two of them end up with the same name, however the rest is cut.
+ */
+static char *stream_file_name(const struct ufile *file, const struct data *d,
+      int nr)
+{
+   const char *name = file->pref_name ? file->pref_name : "noname";
+   char *s = malloc(NAME_MAX + 1);
+   size_t room, name_len, stream_len = 0;
+   char *p;
+
+   if(s == NULL)
+      return NULL;
+   if(nr == 0 && d->name == NULL)
+      p = s + sprintf(s, "%lld_", file->inode);
+   else
+      p = s + sprintf(s, "%lld-%d_", file->inode, nr);
+   room = NAME_MAX - (sizeof(".part") - 1) - (p - s) - (d->name ? 1 : 0);
+   if(d->name)
+   {
+      stream_len = strlen(d->name);
+      if(stream_len + strlen(name) > room)
+         stream_len = utf8_fit(d->name, strlen(name) < room / 2
+               ? room - strlen(name) : room / 2);
+   }
+   name_len = utf8_fit(name, room - stream_len);
+   p = name_append(p, name, name_len);
+   if(d->name)
+   {
+      *p++ = '_';
+      p = name_append(p, d->name, stream_len);
+   }
+   *p = '\0';
+   return s;
+}
+
+/**
+ * extract_ntfs_mft - write out the data streams of the deleted files
+ *
+ * Compressed and encrypted streams are skipped, they would need the
+ * volume's compression or keys to be of any use.  Each written stream
+ * gets its hashes and path filled in.
+ */
+int extract_ntfs_mft(ntfs_volume *vol, const struct mft_table *files,
+      const char *dir, int nr_threads)
+{
+   struct extract_job *job = calloc(1, sizeof(*job));
+   struct list_head *ditem;
+   long n = 0, nr_skipped = 0;
+   int nr, err;
+
+   if(job == NULL)
+      return -1;
+   for(long i = 0; i < files->nr; i++)
+   {
+      struct ufile *file = files->files[i];
+      if(!file->in_use && !file->directory)
+         list_for_each(ditem, &file->data)
+            n++;
+   }
+   job->items = calloc(n ? n : 1, sizeof(*job->items));
+   if(job->items == NULL)
+   {
+      free(job);
+      return -1;
+   }
+   job->vol = vol;
+   job->dir = dir;
+   for(long i = 0; i < files->nr; i++)
+   {
+      struct ufile *file = files->files[i];
+      if(file->in_use || file->directory)
+         continue;
+      nr = -1;
+      list_for_each(ditem, &file->data)
+      {
+         struct data *d = list_entry(ditem, struct data, list);
+         struct extract_item *it = &job->items[job->nr_items];
+         nr++;
+         if(d->compressed || d->encrypted
+               || (d->resident ? d->data == NULL && d->size_data
+                  : d->runlist == NULL))
+         {
+            nr_skipped++;
+            continue;
+         }
+         it->rl = d->runlist;
+         it->resident = d->resident ? d->data : NULL;
+         it->size = d->size_data;
+         it->size_init = d->resident ? d->size_data : d->size_init;
+         it->digest = &d->digest;
+         it->path = &d->path;
+         it->name = stream_file_name(file, d, nr);
+         if(it->name == NULL)
+            nr_skipped++;
+         else
+            job->nr_items++;
+      }
+   }
+   err = extract_run(job, nr_threads, nr_skipped);
+   free(job->items);
+   free(job);
+   return err;
+}
+
+/**
+ * extract_carve_hits - write out the carved candidates
+ *
+ * A candidate is the run of @hit->size bytes from its first cluster.
+ */
+int extract_carve_hits(ntfs_volume *vol, struct carve_hit *hits, long nr_hits,
+      const char *dir, int nr_threads)
+{
+   struct extract_job *job = calloc(1, sizeof(*job));
+   int err;
+
+   if(job == NULL)
+      return -1;
+   job->items = calloc(nr_hits ? nr_hits : 1, sizeof(*job->items));
+   if(job->items == NULL)
+   {
+      free(job);
+      return -1;
+   }
+   job->vol = vol;
+   job->dir = dir;
+   for(long i = 0; i < nr_hits; i++)
+   {
+      struct extract_item *it = &job->items[job->nr_items];
+      s64 clusters = (hits[i].size + vol->cluster_size - 1)
+         >> vol->cluster_size_bits;
+      it->carve_rl[0].vcn = 0;
+      it->carve_rl[0].lcn = hits[i].lcn;
+      it->carve_rl[0].length = clusters;
+      it->carve_rl[1].vcn = clusters;
+      it->carve_rl[1].lcn = LCN_ENOENT;
+      it->carve_rl[1].length = 0;
+      it->rl = it->carve_rl;
+      it->size = it->size_init = hits[i].size;
+      it->digest = &hits[i].digest;
+      it->path = &hits[i].path;
+      it->name = malloc(32 + strlen(hits[i].type));
+      if(it->name == NULL)
+         continue;
+      sprintf(it->name, "carve_%lld.%s", (long long)hits[i].lcn,
+            hits[i].type);
+      job->nr_items++;
+   }
+   err = extract_run(job, nr_threads, nr_hits - job->nr_items);
+   free(job->items);
+   free(job);
+   return err;
+}
@@ -0,0 +1,19 @@
+/*
+ * extract.h - Writing recovered streams out, hashed and deduplicated.
+ */
+
+#ifndef _NTFS_EXTRACT_H
+#define _NTFS_EXTRACT_H
+
+#include "type.h"
+
+struct _ntfs_volume;
+struct mft_table;
+struct carve_hit;
+
+int extract_ntfs_mft(struct _ntfs_volume *, const struct mft_table *,
+		const char *, int);
+int extract_carve_hits(struct _ntfs_volume *, struct carve_hit *, long,
+		const char *, int);
+
+#endif /* defined _NTFS_EXTRACT_H */
@@ -0,0 +1,307 @@
+#include <string.h>
+#include <pthread.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define HAVE_SHA_NI
+#endif
+#include "hash.h"
+
+static const u32 sha256_k[64] = {
+   0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+   0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+   0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+   0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+   0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+   0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+   0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+   0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+   0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+   0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+   0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROR32(x, n)	(((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_blocks_c(u32 *state, const u8 *p, size_t blocks)
+{
+   for(; blocks--; p += SHA256_BLOCK_SIZE)
+   {
+      u32 w[64], s[8];
+      int i;
+
+      for(i = 0; i < 16; i++)
+         w[i] = (u32)p[4 * i] << 24 | (u32)p[4 * i + 1] << 16
+            | (u32)p[4 * i + 2] << 8 | p[4 * i + 3];
+      for(; i < 64; i++)
+      {
+         u32 s0 = ROR32(w[i - 15], 7) ^ ROR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+         u32 s1 = ROR32(w[i - 2], 17) ^ ROR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+         w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+      }
+      memcpy(s, state, sizeof(s));
+      for(i = 0; i < 64; i++)
+      {
+         u32 t1 = s[7] + (ROR32(s[4], 6) ^ ROR32(s[4], 11) ^ ROR32(s[4], 25))
+            + ((s[4] & s[5]) ^ (~s[4] & s[6])) + sha256_k[i] + w[i];
+         u32 t2 = (ROR32(s[0], 2) ^ ROR32(s[0], 13) ^ ROR32(s[0], 22))
+            + ((s[0] & s[1]) ^ (s[0] & s[2]) ^ (s[1] & s[2]));
+         memmove(s + 1, s, 7 * sizeof(u32));
+         s[4] += t1;
+         s[0] = t1 + t2;
+      }
+      for(i = 0; i < 8; i++)
+         state[i] += s[i];
+   }
+}
+
+#ifdef HAVE_SHA_NI
+/*
+ * The SHA extensions do two rounds per instruction.  The state lives in two
+ * registers as ABEF and CDGH, the message schedule in four registers that
+ * take turns, sixteen rounds behind each other.
+ */
+__attribute__((target("sha,sse4.1")))
+static void sha256_blocks_ni(u32 *state, const u8 *p, size_t blocks)
+{
+   const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+         0x0405060700010203ULL);
+   __m128i st0, st1, msg, tmp, w[4];
+
+   tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[0]), 0xb1);
+   st1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[4]), 0x1b);
+   st0 = _mm_alignr_epi8(tmp, st1, 8);
+   st1 = _mm_blend_epi16(st1, tmp, 0xf0);
+
+   for(; blocks--; p += SHA256_BLOCK_SIZE)
+   {
+      __m128i abef = st0, cdgh = st1;
+
+#pragma GCC unroll 16
+      for(int g = 0; g < 16; g++)
+      {
+         if(g < 4)
+            w[g] = _mm_shuffle_epi8(
+                  _mm_loadu_si128((const __m128i *)(p + 16 * g)), bswap);
+         msg = _mm_add_epi32(w[g & 3],
+               _mm_loadu_si128((const __m128i *)&sha256_k[4 * g]));
+         st1 = _mm_sha256rnds2_epu32(st1, st0, msg);
+         if(g >= 3 && g <= 14)
+         {
+            tmp = _mm_alignr_epi8(w[g & 3], w[(g + 3) & 3], 4);
+            w[(g + 1) & 3] = _mm_sha256msg2_epu32(
+                  _mm_add_epi32(w[(g + 1) & 3], tmp), w[g & 3]);
+         }
+         st0 = _mm_sha256rnds2_epu32(st0, st1, _mm_shuffle_epi32(msg, 0x0e));
+         if(g >= 1 && g <= 12)
+            w[(g + 3) & 3] = _mm_sha256msg1_epu32(w[(g + 3) & 3], w[g & 3]);
+      }
+      st0 = _mm_add_epi32(st0, abef);
+      st1 = _mm_add_epi32(st1, cdgh);
+   }
+
+   tmp = _mm_shuffle_epi32(st0, 0x1b);
+   st1 = _mm_shuffle_epi32(st1, 0xb1);
+   st0 = _mm_blend_epi16(tmp, st1, 0xf0);
+   st1 = _mm_alignr_epi8(st1, tmp, 8);
+   _mm_storeu_si128((__m128i *)&state[0], st0);
+   _mm_storeu_si128((__m128i *)&state[4], st1);
+}
+#endif
+
+static void (*sha256_blocks)(u32 *, const u8 *, size_t) = sha256_blocks_c;
+static pthread_once_t sha256_once = PTHREAD_ONCE_INIT;
+
+static void sha256_select(void)
+{
+#ifdef HAVE_SHA_NI
+   unsigned a, b, c, d;
+
+   /* SHA (leaf 7 EBX bit 29), SSSE3 and SSE4.1 (leaf 1 ECX bits 9, 19) */
+   if(__get_cpuid(1, &a, &b, &c, &d) && (c & (1 << 9)) && (c & (1 << 19))
+         && __get_cpuid_count(7, 0, &a, &b, &c, &d) && (b & (1 << 29)))
+      sha256_blocks = sha256_blocks_ni;
+#endif
+}
+
+const char *sha256_impl(void)
+{
+   pthread_once(&sha256_once, sha256_select);
+   return sha256_blocks == sha256_blocks_c ? "generic" : "sha-ni";
+}
+
+void sha256_init(struct sha256_ctx *ctx)
+{
+   static const u32 iv[8] = {
+      0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+      0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+   };
+
+   pthread_once(&sha256_once, sha256_select);
+   memcpy(ctx->state, iv, sizeof(iv));
+   ctx->count = 0;
+}
+
+void sha256_update(struct sha256_ctx *ctx, const void *data, size_t len)
+{
+   const u8 *p = data;
+   size_t fill = ctx->count % SHA256_BLOCK_SIZE;
+
+   ctx->count += len;
+   if(fill)
+   {
+      size_t n = SHA256_BLOCK_SIZE - fill < len ? SHA256_BLOCK_SIZE - fill : len;
+      memcpy(ctx->buf + fill, p, n);
+      p += n;
+      len -= n;
+      if(fill + n < SHA256_BLOCK_SIZE)
+         return;
+      sha256_blocks(ctx->state, ctx->buf, 1);
+   }
+   if(len >= SHA256_BLOCK_SIZE)
+   {
+      sha256_blocks(ctx->state, p, len / SHA256_BLOCK_SIZE);
+      p += len & ~(size_t)(SHA256_BLOCK_SIZE - 1);
+      len %= SHA256_BLOCK_SIZE;
+   }
+   memcpy(ctx->buf, p, len);
+}
+
+void sha256_final(struct sha256_ctx *ctx, u8 *digest)
+{
+   u64 bits = ctx->count * 8;
+   size_t fill = ctx->count % SHA256_BLOCK_SIZE;
+   u8 pad[SHA256_BLOCK_SIZE * 2] = { 0x80 };
+   size_t n = (fill < 56 ? 56 : 120) - fill;
+
+   for(int i = 0; i < 8; i++)
+      pad[n + i] = bits >> (56 - 8 * i);
+   sha256_update(ctx, pad, n + 8);
+   for(int i = 0; i < 8; i++)
+   {
+      digest[4 * i] = ctx->state[i] >> 24;
+      digest[4 * i + 1] = ctx->state[i] >> 16;
+      digest[4 * i + 2] = ctx->state[i] >> 8;
+      digest[4 * i + 3] = ctx->state[i];
+   }
+}
+
+#define XXH_P1	0x9e3779b185ebca87ULL
+#define XXH_P2	0xc2b2ae3d27d4eb4fULL
+#define XXH_P3	0x165667b19e3779f9ULL
+#define XXH_P4	0x85ebca77c2b2ae63ULL
+#define XXH_P5	0x27d4eb2f165667c5ULL
+
+#define ROL64(x, n)	(((x) << (n)) | ((x) >> (64 - (n))))
+
+static inline u64 rd64(const u8 *p)
+{
+   u64 v;
+
+   memcpy(&v, p, 8);
+   return v;
+}
+
+static inline u32 rd32(const u8 *p)
+{
+   u32 v;
+
+   memcpy(&v, p, 4);
+   return v;
+}
+
+static inline u64 xxh64_round(u64 acc, u64 input)
+{
+   acc += input * XXH_P2;
+   acc = ROL64(acc, 31);
+   return acc * XXH_P1;
+}
+
+static inline u64 xxh64_merge(u64 acc, u64 v)
+{
+   acc ^= xxh64_round(0, v);
+   return acc * XXH_P1 + XXH_P4;
+}
+
+void xxh64_init(struct xxh64_ctx *ctx, u64 seed)
+{
+   ctx->v[0] = seed + XXH_P1 + XXH_P2;
+   ctx->v[1] = seed + XXH_P2;
+   ctx->v[2] = seed;
+   ctx->v[3] = seed - XXH_P1;
+   ctx->count = 0;
+}
+
+static const u8 *xxh64_stripes(u64 *v, const u8 *p, size_t len)
+{
+   u64 v0 = v[0], v1 = v[1], v2 = v[2], v3 = v[3];
+
+   for(; len >= 32; p += 32, len -= 32)
+   {
+      v0 = xxh64_round(v0, rd64(p));
+      v1 = xxh64_round(v1, rd64(p + 8));
+      v2 = xxh64_round(v2, rd64(p + 16));
+      v3 = xxh64_round(v3, rd64(p + 24));
+   }
+   v[0] = v0;
+   v[1] = v1;
+   v[2] = v2;
+   v[3] = v3;
+   return p;
+}
+
+void xxh64_update(struct xxh64_ctx *ctx, const void *data, size_t len)
+{
+   const u8 *p = data;
+   size_t fill = ctx->count % 32;
+
+   ctx->count += len;
+   if(fill)
+   {
+      size_t n = 32 - fill < len ? 32 - fill : len;
+      memcpy(ctx->buf + fill, p, n);
+      p += n;
+      len -= n;
+      if(fill + n < 32)
+         return;
+      xxh64_stripes(ctx->v, ctx->buf, 32);
+   }
+   const u8 *end = xxh64_stripes(ctx->v, p, len);
+   memcpy(ctx->buf, end, len % 32);
+}
+
+u64 xxh64_final(struct xxh64_ctx *ctx)
+{
+   const u8 *p = ctx->buf;
+   size_t len = ctx->count % 32;
+   u64 h;
+
+   if(ctx->count >= 32)
+   {
+      h = ROL64(ctx->v[0], 1) + ROL64(ctx->v[1], 7) + ROL64(ctx->v[2], 12)
+         + ROL64(ctx->v[3], 18);
+      for(int i = 0; i < 4; i++)
+         h = xxh64_merge(h, ctx->v[i]);
+   }
+   else
+      h = ctx->v[2] + XXH_P5;
+   h += ctx->count;
+
+   for(; len >= 8; p += 8, len -= 8)
+      h = ROL64(h ^ xxh64_round(0, rd64(p)), 27) * XXH_P1 + XXH_P4;
+   if(len >= 4)
+   {
+      h = ROL64(h ^ (rd32(p) * XXH_P1), 23) * XXH_P2 + XXH_P3;
+      p += 4;
+      len -= 4;
+   }
+   for(; len; p++, len--)
+      h = ROL64(h ^ (*p * XXH_P5), 11) * XXH_P1;
+
+   h ^= h >> 33;
+   h *= XXH_P2;
+   h ^= h >> 29;
+   h *= XXH_P3;
+   h ^= h >> 32;
+   return h;
+}
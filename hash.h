@@ -0,0 +1,53 @@
+/*
+ * hash.h - Content hashes of recovered streams.
+ */
+
+#ifndef _NTFS_HASH_H
+#define _NTFS_HASH_H
+
+#include <stddef.h>
+#include "type.h"
+
+#define SHA256_DIGEST_SIZE	32
+#define SHA256_BLOCK_SIZE	64
+
+/**
+ * struct sha256_ctx - incremental SHA-256
+ */
+struct sha256_ctx {
+	u32 state[8];
+	u64 count;		/* Bytes hashed so far. */
+	u8 buf[SHA256_BLOCK_SIZE];
+};
+
+/**
+ * struct xxh64_ctx - incremental XXH64, the fast non-cryptographic hash
+ *
+ * Cheap enough to find duplicate candidates with; SHA-256 confirms them.
+ */
+struct xxh64_ctx {
+	u64 v[4];
+	u64 count;		/* Bytes hashed so far. */
+	u8 buf[32];
+};
+
+/**
+ * struct stream_digest - hashes of a recovered stream
+ * @valid:	the stream was read in full and the hashes below are set
+ */
+struct stream_digest {
+	int valid;
+	u8 sha256[SHA256_DIGEST_SIZE];
+	u64 xxh64;
+};
+
+void sha256_init(struct sha256_ctx *);
+void sha256_update(struct sha256_ctx *, const void *, size_t);
+void sha256_final(struct sha256_ctx *, u8 *);
+const char *sha256_impl(void);
+
+void xxh64_init(struct xxh64_ctx *, u64);
+void xxh64_update(struct xxh64_ctx *, const void *, size_t);
+u64 xxh64_final(struct xxh64_ctx *);
+
+#endif /* defined _NTFS_HASH_H */
@@ -0,0 +1,270 @@
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "ntfs_recover.h"
+#include "cache.h"
+#include "carve.h"
+#include "direct.h"
+#include "emit.h"
+#include "extract.h"
+#include "extmem.h"
+#include "mftmirr.h"
+#include "overlap.h"
+#include "timeline.h"
+
+static void list_ntfs_info(ntfs_volume *);
+static void list_ntfs_mft(const struct mft_table *, int);
+static void list_carve_hits(ntfs_volume *, struct carve_hit *, long);
+
+int main(int argc, char *argv[])
+{
+   size_t cache_budget = CACHE_DEFAULT_BUDGET;
+   int nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+   int carve = 0, timeline = 0, all = 0, direct = 0, direct_depth = 0;
+   size_t direct_chunk = 0;
+   const char *format = NULL, *output = NULL, *extract = NULL;
+   const char *tmpdir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+   size_t mem_budget = 0;
+   struct emitter *e = NULL;
+   enum emit_format fmt;
+   int opt;
+
+   while((opt = getopt(argc, argv, "ab:c:CDf:Lm:o:q:t:T:x:")) != -1)
+   {
+      switch(opt)
+      {
+      case 'a':
+         all = 1;
+         break;
+      case 'b':
+         direct_chunk = strtoull(optarg, NULL, 0) << 10;
+         break;
+      case 'c':
+         cache_budget = strtoull(optarg, NULL, 0) << 20;
+         break;
+      case 'C':
+         carve = 1;
+         break;
+      case 'D':
+         direct = 1;
+         break;
+      case 'f':
+         format = optarg;
+         break;
+      case 'L':
+         timeline = 1;
+         break;
+      case 'm':
+         mem_budget = strtoull(optarg, NULL, 0) << 20;
+         break;
+      case 'o':
+         output = optarg;
+         break;
+      case 'q':
+         direct_depth = atoi(optarg);
+         break;
+      case 't':
+         nr_threads = atoi(optarg);
+         break;
+      case 'T':
+         tmpdir = optarg;
+         break;
+      case 'x':
+         extract = optarg;
+         break;
+      default:
+         optind = argc;
+         break;
+      }
+   }
+   if(optind != argc - 1 || (format && emit_parse_format(format, &fmt) < 0)
+         || (mem_budget && extract && !carve)
+         || (timeline && carve)
+         || (all && (carve || timeline))
+         || (!direct && (direct_chunk || direct_depth)))
+   {
+      printf("Usage: %s [-C | -L | -a] [-c cache_MiB] [-t threads] "
+            "[-f ndjson|csv|bin] [-o output] [-x dir] "
+            "[-m memory_MiB [-T tmpdir]] [-D [-b chunk_KiB] [-q depth]] "
+            "<NTFS_fs>\n", argv[0]);
+      return -1;
+   }
+   if(mem_budget && mem_budget < EXTMEM_MIN_BUDGET)
+   {
+      fprintf(stderr, "[ERROR] -m takes %d MiB at least\n",
+            EXTMEM_MIN_BUDGET >> 20);
+      return -1;
+   }
+   /* The cache is part of the memory budget, not on top of it */
+   if(mem_budget && cache_budget > mem_budget / 8)
+      cache_budget = mem_budget / 8;
+   if(mem_budget && cache_budget > mem_budget - EXTMEM_MIN_BUDGET)
+      cache_budget = mem_budget - EXTMEM_MIN_BUDGET;
+   if(format)
+   {
+      /* Records go to the output, the [INFO] reports to stderr */
+      int fd = output ? open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644)
+         : dup(STDOUT_FILENO);
+      if(fd < 0 || (!output && dup2(STDERR_FILENO, STDOUT_FILENO) < 0))
+      {
+         fprintf(stderr, "[ERROR] Opening %s failed\n",
+               output ? output : "stdout");
+         return -1;
+      }
+      e = emit_open(fd, fmt, nr_threads);
+      if(e == NULL)
+      {
+         close(fd);
+         return -1;
+      }
+   }
+   ntfs_volume *vol = direct ? ntfs_volume_open_direct(argv[optind],
+         direct_chunk, direct_depth) : ntfs_volume_open(argv[optind]);
+   if(vol == NULL)
+      return -1;
+   list_ntfs_info(vol);
+   if(cache_budget)
+      vol->dev->d_cache = ntfs_cache_alloc(vol->dev, vol->cluster_size,
+            cache_budget);
+
+   struct mft_table files = { NULL, 0 };
+   if(carve)
+   {
+      struct carve_hit *hits;
+      long nr_hits = carve_ntfs(vol, nr_threads, &hits);
+      if(nr_hits >= 0 && extract)
+         extract_carve_hits(vol, hits, nr_hits, extract, nr_threads);
+      if(nr_hits >= 0 && e)
+         emit_carve_hits(e, hits, nr_hits, vol->cluster_size);
+      else if(nr_hits >= 0)
+         list_carve_hits(vol, hits, nr_hits);
+      for(long i = 0; i < nr_hits; i++)
+         free(hits[i].path);
+      if(nr_hits >= 0)
+         free(hits);
+   }
+   else if(mem_budget)
+      extmem_ntfs_mft(vol, mem_budget - cache_budget, tmpdir, e,
+            (all ? EXTMEM_ALL : 0) | (timeline ? EXTMEM_TIMELINE : 0),
+            nr_threads);
+   else if(load_ntfs_mft(vol, &files, nr_threads) >= 0)
+   {
+      score_ntfs_mft(vol, &files);
+      overlap_ntfs_mft(&files);
+      if(extract)
+         extract_ntfs_mft(vol, &files, extract, nr_threads);
+      if(timeline)
+         timeline_ntfs_mft(&files, e, nr_threads);
+      else if(e)
+         emit_ntfs_mft(e, &files, all, nr_threads);
+      else
+         list_ntfs_mft(&files, all);
+   }
+   if(e)
+   {
+      int fd = e->fd;
+      if(emit_close(e) < 0)
+         fprintf(stderr, "[ERROR] Writing the records failed\n");
+      close(fd);
+   }
+
+   if(vol->dev->d_cache)
+   {
+      struct ntfs_cache_stats st;
+      ntfs_cache_get_stats(vol->dev->d_cache, &st);
+      printf("\nCACHE INFO\n");
+      printf("--------------------------------------------\n");
+      printf(" [INFO] Hits: %llu\n", (unsigned long long)st.hits);
+      printf(" [INFO] Misses: %llu\n", (unsigned long long)st.misses);
+      printf(" [INFO] Read ahead: %llu\n", (unsigned long long)st.readahead);
+      printf(" [INFO] Evictions: %llu\n", (unsigned long long)st.evictions);
+      printf(" [INFO] Bypassed: %llu\n", (unsigned long long)st.bypassed);
+   }
+   if(vol->dev->d_direct)
+   {
+      struct ntfs_direct_stats st;
+      ntfs_direct_get_stats(vol->dev->d_direct, &st);
+      printf("\nDIRECT I/O INFO\n");
+      printf("--------------------------------------------\n");
+      printf(" [INFO] Block size: %u\n", st.block_size);
+      printf(" [INFO] Chunk size: %u\n", st.chunk);
+      printf(" [INFO] Queue depth: %d\n", st.depth);
+      printf(" [INFO] Requests: %llu\n", (unsigned long long)st.reads);
+      printf(" [INFO] Bytes read: %llu\n", (unsigned long long)st.bytes);
+      printf(" [INFO] Bounced: %llu\n", (unsigned long long)st.bounced);
+      printf(" [INFO] Waits for a free slot: %llu\n",
+            (unsigned long long)st.waits);
+   }
+   free_ntfs_mft(&files);
+   ntfs_volume_close(vol);
+   return 0;
+}
+
+/* What the boot sector and the check of $MFTMirr tell about @vol */
+static void list_ntfs_info(ntfs_volume *vol)
+{
+   const struct mftmirr_stats *st = &vol->mftmirr_stats;
+   NTFS_BOOT_SECTOR s;
+
+   if(ntfs_device_pread(vol->dev, 0, sizeof(s), &s) == sizeof(s))
+   {
+      BIOS_PARAMETER_BLOCK b = s.bpb;
+
+      printf("NTFS BOOT SECTOR INFO\n");
+      printf("--------------------------------------------\n");
+      printf(" [INFO] Number of Sectors: %lld\n", s.number_of_sectors);
+      printf(" [INFO] Cluster location of MFT Data: %lld\n", s.mft_lcn);
+      printf(" [INFO] Cluster location of MFT copy: %lld\n", s.mftmirr_lcn);
+      printf(" [INFO] Clusters per MFT Record: %d\n", s.clusters_per_mft_record);
+      printf(" [INFO] Clusters per Index Record: %d\n", s.clusters_per_index_record);
+      printf(" [INFO] Boot Sector Checksum: 0x%08X\n", s.checksum);
+      printf("\n");
+
+      printf("BIOS PARAMETER BLOCK INFO\n");
+      printf("--------------------------------------------\n");
+      printf(" [INFO] Bytes per Sector: %d\n", b.bytes_per_sector);
+      printf(" [INFO] Sectors per Cluster: %d\n", b.sectors_per_cluster);
+      printf(" [INFO] MFT zone size: %d\n", b.sectors_per_cluster*s.number_of_sectors>>3); //12.5%
+      printf(" [INFO] Data1 Zone Position: 0x%08X\n", vol->data1_zone_pos);
+      printf(" [INFO] Data2 Zone Position: 0x%08X\n", vol->data2_zone_pos);
+
+      printf("\n");
+   }
+
+   if(st->nr_records)
+   {
+      printf("MFT MIRROR INFO\n");
+      printf("--------------------------------------------\n");
+      printf(" [INFO] Records compared: %d\n", st->nr_records);
+      printf(" [INFO] Differing: %d\n", st->nr_differ);
+      printf(" [INFO] Taken from $MFTMirr: %d\n", st->nr_from_mirror);
+      printf(" [INFO] Damaged in both: %d\n", st->nr_lost);
+      printf("\n");
+   }
+}
+
+/* The deleted files of @files, and with @all those in use as well */
+static void list_ntfs_mft(const struct mft_table *files, int all)
+{
+   list_ntfs_header();
+   for(long i = 0; i < files->nr; i++)
+      if(all || !files->files[i]->in_use)
+         list_ntfs_file(files->files[i]);
+}
+
+static void list_carve_hits(ntfs_volume *vol, struct carve_hit *hits,
+      long nr_hits)
+{
+   printf("CARVE INFO\n");
+   printf("--------------------------------------------\n");
+   printf(" [INFO] Candidates: %ld\n", nr_hits);
+   printf("\n");
+   printf("LCN          Offset         Size          Type    End\n");
+   printf("--------------------------------------------\n");
+   for(long i = 0; i < nr_hits; i++)
+      printf("%-12lld %-14lld %-13lld %-7s %s\n", (long long)hits[i].lcn,
+            (long long)hits[i].lcn << vol->cluster_size_bits,
+            (long long)hits[i].size, hits[i].type,
+            hits[i].complete ? "found" : "truncated");
+}
@@ -0,0 +1,217 @@
+#include <stdlib.h>
+#include <string.h>
+#include "ntfs_recover.h"
+#include "mftiter.h"
+
+/**
+ * struct mft_iter - a pull cursor over the mft records of a volume
+ * @held:	records parsed for the views handed out last, freed on the
+ *		next call
+ */
+struct mft_iter {
+   struct mft_cursor    cur;
+   struct mft_iter_opts opts;
+   struct ufile         **held;
+   long                 nr_held;
+   long                 size_held;
+};
+
+/**
+ * mft_iter_open - start walking the mft records of @vol
+ * @opts:	what to return and from where, NULL for every base record
+ *
+ * Nothing is read until the first mft_iter_next(); memory use is one
+ * chunk of $MFT plus the records of one batch, whatever the volume size.
+ */
+struct mft_iter *mft_iter_open(ntfs_volume *vol,
+      const struct mft_iter_opts *opts)
+{
+   struct mft_iter *it = calloc(1, sizeof(*it));
+
+   if(it == NULL)
+      return NULL;
+   if(opts)
+      it->opts = *opts;
+   if((it->opts.flags & (MFT_ITER_DELETED | MFT_ITER_IN_USE)) == 0)
+      it->opts.flags |= MFT_ITER_DELETED | MFT_ITER_IN_USE;
+   if(ntfs_mft_cursor_init(&it->cur, vol, it->opts.chunk_size,
+            it->opts.start) < 0)
+   {
+      free(it);
+      return NULL;
+   }
+   return it;
+}
+
+static void release_held(struct mft_iter *it)
+{
+   for(long i = 0; i < it->nr_held; i++)
+      free_ufile(it->held[i]);
+   it->nr_held = 0;
+}
+
+static int hold(struct mft_iter *it, struct ufile *file)
+{
+   if(it->nr_held == it->size_held)
+   {
+      long n = it->size_held ? it->size_held * 2 : 16;
+      struct ufile **h = realloc(it->held, n * sizeof(*h));
+      if(h == NULL)
+         return -1;
+      it->held = h;
+      it->size_held = n;
+   }
+   it->held[it->nr_held++] = file;
+   return 0;
+}
+
+static void fill_view(struct mft_view *v, struct ufile *file,
+      const MFT_RECORD *m, u32 record_size)
+{
+   struct list_head *item;
+   struct filename *pref = NULL;
+
+   memset(v, 0, sizeof(*v));
+   v->mft_no = file->inode;
+   v->base_mft_no = MREF(m->base_mft_record);
+   v->in_use = file->in_use;
+   v->directory = file->directory;
+   v->attr_list = file->attr_list;
+   v->date = file->date;
+   v->size = file->max_size;
+   list_for_each(item, &file->name)
+   {
+      struct filename *f = list_entry(item, struct filename, list);
+      /* Win32 over DOS, as resolve_names() picks them */
+      if(pref == NULL || pref->name_space == FILE_NAME_DOS)
+         pref = f;
+      v->nr_names++;
+   }
+   list_for_each(item, &file->data)
+      v->nr_streams++;
+   if(pref)
+   {
+      v->name = pref->name;
+      v->parent_mft_no = MREF(pref->parent_mref);
+   }
+   v->record = m;
+   v->record_size = record_size;
+   v->file = file;
+}
+
+static int wanted(const struct mft_iter *it, const MFT_RECORD *m)
+{
+   unsigned flags = it->opts.flags;
+
+   if(m->flags & MFT_RECORD_IN_USE ? !(flags & MFT_ITER_IN_USE)
+         : !(flags & MFT_ITER_DELETED))
+      return 0;
+   if(MREF(m->base_mft_record) && !(flags & MFT_ITER_EXTENSIONS))
+      return 0;
+   if((m->flags & MFT_RECORD_IS_DIRECTORY) && (flags & MFT_ITER_NO_DIRS))
+      return 0;
+   return 1;
+}
+
+/* The next record in the buffer, or 0 if getting one means reading */
+/*
+ * Find the next record passing the filter.  The raw record is checked
+ * first so unwanted ones are not parsed at all.  With @more set it stops
+ * at the end of the chunk read already, records it skips included.
+ */
+static int next_view(struct mft_iter *it, struct mft_view *v, int more)
+{
+   MFT_RECORD *m;
+   u64 mft_no;
+
+   it->cur.stop_at_chunk_end = more;
+   while((m = ntfs_mft_cursor_next(&it->cur, &mft_no)))
+   {
+      if(!wanted(it, m))
+         continue;
+      struct ufile *file = parse_mft_record(it->cur.vol, m, mft_no);
+      if(file == NULL || hold(it, file) < 0)
+      {
+         free_ufile(file);
+         return -1;
+      }
+      fill_view(v, file, m, it->cur.vol->mft_record_size);
+      if(v->size >= it->opts.min_size
+            && (it->opts.match == NULL || it->opts.match(v, it->opts.arg)))
+         return 1;
+      free_ufile(it->held[--it->nr_held]);
+   }
+   return it->cur.err ? -1 : 0;
+}
+
+/**
+ * mft_iter_next - the next matching record
+ *
+ * Returns 1 with @v filled in, 0 at the end of the mft or -1 on error.
+ * Views returned earlier are no longer valid.
+ */
+int mft_iter_next(struct mft_iter *it, struct mft_view *v)
+{
+   release_held(it);
+   return next_view(it, v, 0);
+}
+
+/**
+ * mft_iter_next_batch - up to @n matching records at once
+ *
+ * A batch ends early where the next record would have to be read from
+ * the device, so that all views in it point into the same read buffer;
+ * they stay valid until the next call.  Returns the number of views
+ * filled in (0 at the end of the mft), or -1 on error.
+ */
+long mft_iter_next_batch(struct mft_iter *it, struct mft_view *v, long n)
+{
+   long nr = 0;
+
+   release_held(it);
+   while(nr < n)
+   {
+      int r = next_view(it, &v[nr], nr > 0);
+      if(r < 0)
+         return nr ? nr : -1;
+      if(r == 0)
+         break;
+      nr++;
+   }
+   return nr;
+}
+
+/**
+ * mft_iter_tell - where to start again to get the records not returned yet
+ */
+u64 mft_iter_tell(const struct mft_iter *it)
+{
+   return it->cur.next;
+}
+
+/**
+ * mft_iter_seek - continue with record @mft_no
+ */
+void mft_iter_seek(struct mft_iter *it, u64 mft_no)
+{
+   release_held(it);
+   ntfs_mft_cursor_seek(&it->cur, mft_no);
+}
+
+/**
+ * mft_iter_bad - records skipped so far because they failed the fixup check
+ */
+long mft_iter_bad(const struct mft_iter *it)
+{
+   return it->cur.nr_bad;
+}
+
+void mft_iter_close(struct mft_iter *it)
+{
+   if(it == NULL)
+      return;
+   release_held(it);
+   free(it->held);
+   ntfs_mft_cursor_free(&it->cur);
+   free(it);
+}
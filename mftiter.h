@@ -0,0 +1,90 @@
+/*
+ * mftiter.h - Pulling mft records out of a volume one at a time.
+ *
+ * This header does not pull in ntfs_recover.h, so it can be used from C++
+ * (see mftiter.hpp) and by callers that only want the records.  Link with
+ * libntfsrecover.a, which `make` builds next to the ntfs_recover tool.
+ */
+
+#ifndef _NTFS_MFTITER_H
+#define _NTFS_MFTITER_H
+
+#include <stddef.h>
+#include <time.h>
+#include "type.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct _ntfs_volume;
+struct ufile;
+struct mft_iter;
+struct mft_view;
+
+/* Which records mft_iter_next() returns */
+#define MFT_ITER_DELETED	0x01	/* Records not in use */
+#define MFT_ITER_IN_USE		0x02	/* Records in use */
+#define MFT_ITER_EXTENSIONS	0x04	/* Extension records as well */
+#define MFT_ITER_NO_DIRS	0x08	/* Skip directories */
+
+/**
+ * struct mft_iter_opts - how to walk the mft
+ * @chunk_size:	bytes of $MFT read at a time, 0 for the default
+ * @start:	first record number, e.g. from mft_iter_tell()
+ * @flags:	MFT_ITER_*, 0 for deleted and in use base records
+ * @min_size:	skip records whose largest stream is smaller
+ * @match:	if set, only records it returns non-zero for
+ */
+struct mft_iter_opts {
+	size_t chunk_size;
+	u64 start;
+	unsigned flags;
+	long long min_size;
+	int (*match)(const struct mft_view *, void *);
+	void *arg;
+};
+
+/**
+ * struct mft_view - one mft record as the iterator returns it
+ *
+ * Nothing in here is a copy: @record points into the iterator's read
+ * buffer and the strings into the parsed record.  A view is valid until
+ * the next call on its iterator.  Every record passing the flags is parsed
+ * in full, so that @match and @min_size can look at its names and sizes.
+ */
+struct mft_view {
+	u64 mft_no;		/* MFT record number */
+	u64 base_mft_no;	/* Base record of an extension, else 0 */
+	int in_use;		/* Record is not deleted */
+	int directory;		/* Record is a directory */
+	int attr_list;		/* Record may be one of many */
+	time_t date;		/* Last modification date/time */
+	const char *name;	/* Preferred filename, NULL if none */
+	u64 parent_mft_no;	/* Directory @name is in */
+	long long size;		/* Largest size we find */
+	int nr_names;		/* Filenames in the record */
+	int nr_streams;		/* Data streams in the record */
+	const void *record;	/* Raw record after fixup */
+	u32 record_size;	/* and its size */
+	const struct ufile *file;	/* Everything parsed out of it */
+};
+
+struct _ntfs_volume *ntfs_volume_open(const char *);
+struct _ntfs_volume *ntfs_volume_open_direct(const char *, size_t, int);
+void ntfs_volume_close(struct _ntfs_volume *);
+
+struct mft_iter *mft_iter_open(struct _ntfs_volume *,
+		const struct mft_iter_opts *);
+int mft_iter_next(struct mft_iter *, struct mft_view *);
+long mft_iter_next_batch(struct mft_iter *, struct mft_view *, long);
+u64 mft_iter_tell(const struct mft_iter *);
+void mft_iter_seek(struct mft_iter *, u64);
+long mft_iter_bad(const struct mft_iter *);
+void mft_iter_close(struct mft_iter *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* defined _NTFS_MFTITER_H */
@@ -0,0 +1,91 @@
+/*
+ * mftiter.hpp - The mft record iterator as a C++ range.
+ *
+ *	ntfs::mft_records recs(vol);
+ *	for(const mft_view &v : recs)
+ *		...
+ *	if(recs.failed())
+ *		...
+ *
+ * Records are read as the loop asks for them; a view is only valid until
+ * the loop moves on.  Stop early and pick up later with tell() and seek().
+ */
+
+#ifndef _NTFS_MFTITER_HPP
+#define _NTFS_MFTITER_HPP
+
+#include <cstddef>
+#include <iterator>
+#include "mftiter.h"
+
+namespace ntfs {
+
+class mft_records {
+public:
+	class iterator {
+	public:
+		typedef std::input_iterator_tag iterator_category;
+		typedef mft_view value_type;
+		typedef std::ptrdiff_t difference_type;
+		typedef const mft_view *pointer;
+		typedef const mft_view &reference;
+
+		iterator() : r_(0) {}
+		explicit iterator(mft_records *r) : r_(r) { advance(); }
+
+		reference operator*() const { return r_->view_; }
+		pointer operator->() const { return &r_->view_; }
+		iterator &operator++() { advance(); return *this; }
+		void operator++(int) { advance(); }
+
+		bool operator==(const iterator &o) const { return r_ == o.r_; }
+		bool operator!=(const iterator &o) const { return r_ != o.r_; }
+
+	private:
+		void advance()
+		{
+			if(r_ && !r_->next())
+				r_ = 0;
+		}
+
+		mft_records *r_;
+	};
+
+	explicit mft_records(struct _ntfs_volume *vol,
+			const mft_iter_opts *opts = 0)
+		: it_(mft_iter_open(vol, opts)), failed_(it_ == 0) {}
+	~mft_records() { mft_iter_close(it_); }
+
+	/* Only one pass over the records, so only one owner */
+	mft_records(const mft_records &) = delete;
+	mft_records &operator=(const mft_records &) = delete;
+
+	iterator begin() { return iterator(it_ ? this : 0); }
+	iterator end() { return iterator(); }
+
+	/* True if the walk stopped on an error rather than at the end */
+	bool failed() const { return failed_; }
+	u64 tell() const { return it_ ? mft_iter_tell(it_) : 0; }
+	void seek(u64 mft_no)
+	{
+		if(it_)
+			mft_iter_seek(it_, mft_no);
+	}
+
+private:
+	bool next()
+	{
+		int r = mft_iter_next(it_, &view_);
+		if(r < 0)
+			failed_ = true;
+		return r > 0;
+	}
+
+	mft_iter *it_;
+	mft_view view_;
+	bool failed_;
+};
+
+} /* namespace ntfs */
+
+#endif /* defined _NTFS_MFTITER_HPP */
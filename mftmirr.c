@@ -0,0 +1,185 @@
+#include <pthread.h>
+#include <string.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include "ntfs_recover.h"
+#include "mftmirr.h"
+
+/* One copy of the mirrored records, read on a thread of its own */
+struct mftmirr_read {
+   ntfs_volume *vol;
+   s64         pos;
+   s64         len;
+   u8          *buf;
+   int         err;
+   pthread_t   thread;
+};
+
+static void *read_copy(void *arg)
+{
+   struct mftmirr_read *r = arg;
+
+   if(ntfs_pread(r->vol, r->pos, r->len, r->buf) != r->len)
+      r->err = -1;
+   return NULL;
+}
+
+/*
+ * Offset of the first byte where @a and @b differ, or @len if they are the
+ * same.  Compares 64 bytes per round where SSE2 is there.
+ */
+static u32 mem_diff(const u8 *a, const u8 *b, u32 len)
+{
+   u32 i = 0;
+
+#if defined(__SSE2__)
+   for(; i + 64 <= len; i += 64)
+   {
+      __m128i x0 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + i)),
+            _mm_loadu_si128((const __m128i *)(b + i)));
+      __m128i x1 = _mm_cmpeq_epi8(
+            _mm_loadu_si128((const __m128i *)(a + i + 16)),
+            _mm_loadu_si128((const __m128i *)(b + i + 16)));
+      __m128i x2 = _mm_cmpeq_epi8(
+            _mm_loadu_si128((const __m128i *)(a + i + 32)),
+            _mm_loadu_si128((const __m128i *)(b + i + 32)));
+      __m128i x3 = _mm_cmpeq_epi8(
+            _mm_loadu_si128((const __m128i *)(a + i + 48)),
+            _mm_loadu_si128((const __m128i *)(b + i + 48)));
+      __m128i all = _mm_and_si128(_mm_and_si128(x0, x1),
+            _mm_and_si128(x2, x3));
+      if(_mm_movemask_epi8(all) != 0xffff)
+         break;
+   }
+   for(; i + 16 <= len; i += 16)
+   {
+      int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(
+               _mm_loadu_si128((const __m128i *)(a + i)),
+               _mm_loadu_si128((const __m128i *)(b + i))));
+      if(mask != 0xffff)
+         return i + __builtin_ctz(~mask & 0xffff);
+   }
+#endif
+   for(; i < len; i++)
+      if(a[i] != b[i])
+         return i;
+   return len;
+}
+
+/* Fix up one copy of a record in place, 0 if it is intact */
+static int check_copy(ntfs_volume *vol, MFT_RECORD *m)
+{
+   if(m->magic != magic_FILE
+         || ntfs_mst_post_read_fixup(m, vol->mft_record_size) < 0
+         || m->bytes_in_use > vol->mft_record_size)
+      return -1;
+   return 0;
+}
+
+/**
+ * ntfs_check_mftmirr - compare the records $MFTMirr mirrors with $MFT
+ *
+ * Both copies of the first @vol->mftmirr_size records are read at once,
+ * fixed up and compared.  The copy to use of each record is kept in
+ * @vol->mft_sys: the one in $MFT, or the mirror's where the $MFT copy is
+ * damaged, so $MFT can be found and listed even when its own record is
+ * unreadable.  Records intact in neither are left zeroed.  Returns 0, or -1
+ * if neither copy could be read at all.
+ */
+int ntfs_check_mftmirr(ntfs_volume *vol, struct mftmirr_stats *st)
+{
+   s64 len = (s64)vol->mftmirr_size << vol->mft_record_size_bits;
+   struct mftmirr_read mft = { vol, vol->mft_lcn << vol->cluster_size_bits,
+      len, NULL, 0, 0 };
+   struct mftmirr_read mirr = { vol,
+      vol->mftmirr_lcn << vol->cluster_size_bits, len, NULL, 0, 0 };
+   int threaded;
+
+   memset(st, 0, sizeof(*st));
+   if(vol->mftmirr_size <= 0)
+      return 0;
+   mft.buf = malloc(len);
+   mirr.buf = malloc(len);
+   if(mft.buf == NULL || mirr.buf == NULL)
+   {
+      free(mft.buf);
+      free(mirr.buf);
+      return -1;
+   }
+   threaded = pthread_create(&mirr.thread, NULL, read_copy, &mirr) == 0;
+   read_copy(&mft);
+   if(threaded)
+      pthread_join(mirr.thread, NULL);
+   else
+      read_copy(&mirr);
+   if(mft.err && mirr.err)
+   {
+      fprintf(stderr, "[ERROR] Reading $MFT and $MFTMirr failed\n");
+      free(mft.buf);
+      free(mirr.buf);
+      return -1;
+   }
+
+   st->nr_records = vol->mftmirr_size;
+   for(int i = 0; i < vol->mftmirr_size; i++)
+   {
+      size_t ofs = (size_t)i << vol->mft_record_size_bits;
+      MFT_RECORD *a = (MFT_RECORD *)(mft.buf + ofs);
+      MFT_RECORD *b = (MFT_RECORD *)(mirr.buf + ofs);
+      int a_ok = !mft.err && check_copy(vol, a) == 0;
+      int b_ok = !mirr.err && check_copy(vol, b) == 0;
+      if(a_ok && b_ok)
+      {
+         u32 diff = mem_diff((u8 *)a, (u8 *)b, a->bytes_in_use);
+         if(diff < a->bytes_in_use)
+         {
+            fprintf(stderr, "[WARN] $MFTMirr differs from $MFT in record %d "
+                  "at offset %u\n", i, diff);
+            st->nr_differ++;
+         }
+      }
+      else if(b_ok)
+      {
+         fprintf(stderr, "[WARN] $MFT record %d is damaged, using "
+               "$MFTMirr\n", i);
+         memcpy(a, b, vol->mft_record_size);
+         st->nr_from_mirror++;
+      }
+      else if(!a_ok)
+      {
+         /* A record never written in either copy is not damage */
+         if((!mft.err && a->magic == magic_FILE)
+               || (!mirr.err && b->magic == magic_FILE))
+         {
+            fprintf(stderr, "[WARN] $MFT record %d is damaged in both "
+                  "copies\n", i);
+            st->nr_lost++;
+         }
+         memset(a, 0, vol->mft_record_size);
+      }
+   }
+   free(mirr.buf);
+   vol->mft_sys = mft.buf;
+   return 0;
+}
+
+/**
+ * ntfs_mftmirr_record - the checked copy of mirrored mft record @mft_no
+ *
+ * Returns 0 with the fixed up record in @m, -1 if neither copy holds it,
+ * or 1 if @mft_no is not one ntfs_check_mftmirr() has checked.
+ */
+int ntfs_mftmirr_record(ntfs_volume *vol, u64 mft_no, void *m)
+{
+   const MFT_RECORD *r;
+
+   if(vol->mft_sys == NULL || mft_no >= (u64)vol->mftmirr_size)
+      return 1;
+   r = (const MFT_RECORD *)(vol->mft_sys
+         + ((size_t)mft_no << vol->mft_record_size_bits));
+   if(r->magic != magic_FILE)
+      return -1;
+   memcpy(m, r, vol->mft_record_size);
+   return 0;
+}
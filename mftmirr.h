@@ -0,0 +1,25 @@
+/*
+ * mftmirr.h - Checking $MFT against $MFTMirr.
+ */
+
+#ifndef _NTFS_MFTMIRR_H
+#define _NTFS_MFTMIRR_H
+
+#include "type.h"
+
+struct _ntfs_volume;
+
+/**
+ * struct mftmirr_stats - what ntfs_check_mftmirr() found
+ */
+struct mftmirr_stats {
+	int nr_records;		/* Records both copies should hold. */
+	int nr_differ;		/* Both intact but not the same. */
+	int nr_from_mirror;	/* Damaged in $MFT, taken from $MFTMirr. */
+	int nr_lost;		/* Damaged in both copies. */
+};
+
+int ntfs_check_mftmirr(struct _ntfs_volume *, struct mftmirr_stats *);
+int ntfs_mftmirr_record(struct _ntfs_volume *, u64, void *);
+
+#endif /* defined _NTFS_MFTMIRR_H */
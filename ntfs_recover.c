@@ -1,37 +1,1594 @@
+#include <pthread.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
 #include "ntfs_recover.h"
+#include "cache.h"
+#include "direct.h"
+#include "mftmirr.h"
 
-int main(int argc, char *argv[])
+/* An extension record waiting to be joined to its base record */
+struct mft_extent {
+   u64          base;		/* MFT record number of the base record */
+   u16          seq;		/* and the sequence number it expects */
+   struct ufile *file;		/* Attributes parsed out of the extension */
+};
+
+/*
+ * The records parsed out of one chunk of $MFT, in record order.  Base
+ * records have a @base of 0.  Every worker fills parts of its own and
+ * publishes them when done, see publish_part().
+ */
+struct mft_part {
+   struct mft_part   *next;
+   u64               chunk;
+   long              nr;
+   struct mft_extent rec[];
+};
+
+struct mft_load {
+   ntfs_volume     *vol;
+   u64             nr_chunks;
+   u64             next_chunk;	/* Taken atomically by the workers */
+   u32             per_chunk;	/* Records in a chunk */
+   struct mft_part *parts;	/* Finished parts, a lock-free stack */
+   long            nr_bad;
+};
+
+static ntfs_volume *volume_open(const char *path, struct ntfs_direct *d)
 {
-   if(argc < 2)
+   NTFS_BOOT_SECTOR boot_sector;
+   ntfs_volume *vol = (ntfs_volume *)calloc(1, sizeof(ntfs_volume));
+   struct ntfs_device *dev = calloc(1, sizeof(*dev));
+   FILE *fp = fopen(path, "rb");
+
+   if(fp == NULL)
    {
-      printf("Usage: %s <NTFS_fs>\n", argv[0]);
-      return -1;
+      fprintf(stderr, "[ERROR] Opening %s failed\n", path);
+      goto err;
    }
-   NTFS_BOOT_SECTOR boot_sector;
-   FILE *fp = fopen(argv[1], "rb");
-   if(fread(&boot_sector, sizeof(char), sizeof(boot_sector), fp)
+   if(vol == NULL || dev == NULL || (dev->d_name = strdup(path)) == NULL)
+   {
+      fprintf(stderr, "[ERROR] Allocating memory for NTFS Volumne failed\n");
+      goto err;
+   }
+   dev->d_fp = fp;
+   dev->d_direct = d;
+   if(ntfs_device_pread(dev, 0, sizeof(boot_sector), &boot_sector)
          != sizeof(NTFS_BOOT_SECTOR))
    {
       fprintf(stderr, "[ERROR] Reading file failed\n");
+      goto err;
+   }
+   if(boot_sector.oem_id != NTFS_SB_MAGIC)
+   {
+      fprintf(stderr, "[ERROR] %s is not an NTFS volume\n", path);
+      goto err;
+   }
+   vol->dev = dev;
+   fill_ntfs_info(vol, boot_sector);
+   if(d)
+      ntfs_direct_set_sector_size(d, vol->sector_size);
+
+   ntfs_check_mftmirr(vol, &vol->mftmirr_stats);
+   return vol;
+
+err:
+   ntfs_direct_close(d);
+   if(fp)
       fclose(fp);
+   if(dev)
+      free(dev->d_name);
+   free(dev);
+   free(vol);
+   return NULL;
+}
+
+/**
+ * ntfs_volume_open - open the NTFS volume (device or image) at @path
+ *
+ * Reads the boot sector and fills in the geometry, then checks the records
+ * $MFTMirr mirrors against $MFT, leaving what it found in
+ * @vol->mftmirr_stats; $MFT and $Bitmap are loaded on first use.  Nothing
+ * is printed but warnings and errors, to stderr.  Returns NULL, with the
+ * reason on stderr, if @path cannot be read or does not hold an NTFS volume.
+ */
+ntfs_volume *ntfs_volume_open(const char *path)
+{
+   return volume_open(path, NULL);
+}
+
+/**
+ * ntfs_volume_open_direct - ntfs_volume_open() reading with O_DIRECT
+ *
+ * Every read of the device, the boot sector included, bypasses the page
+ * cache and goes out in requests of at most @chunk bytes, @depth at a time
+ * (0 for the defaults), see ntfs_direct_open().  Falls back to ordinary
+ * reads, with a warning, where @path does not support O_DIRECT.
+ */
+ntfs_volume *ntfs_volume_open_direct(const char *path, size_t chunk,
+      int depth)
+{
+   struct ntfs_direct *d = ntfs_direct_open(path, chunk, depth);
+
+   if(d == NULL)
+      fprintf(stderr, "[WARN] Opening %s with O_DIRECT failed, reading "
+            "through the page cache\n", path);
+   return volume_open(path, d);
+}
+
+void ntfs_volume_close(ntfs_volume *vol)
+{
+   if(vol == NULL)
+      return;
+   if(vol->dev->d_cache)
+      ntfs_cache_free(vol->dev->d_cache);
+   if(vol->mft_na)
+   {
+      free(vol->mft_na->rl);
+      free(vol->mft_na);
+   }
+   if(vol->lcnbmp_na)
+   {
+      free(vol->lcnbmp_na->rl);
+      free(vol->lcnbmp_na);
+   }
+   free(vol->mft_sys);
+   ntfs_direct_close(vol->dev->d_direct);
+   fclose(vol->dev->d_fp);
+   free(vol->dev->d_name);
+   free(vol->dev);
+   free(vol);
+}
+
+/*
+ * pread(2) rather than fseek+fread on the shared stream, so any number of
+ * threads can read the device at once.  Returns the bytes read, which is
+ * short only at the end of the device, or -1 on error.
+ */
+s64 ntfs_device_pread(struct ntfs_device *dev, s64 pos, s64 count, void *b)
+{
+   int fd = fileno(dev->d_fp);
+   s64 total = 0;
+
+   if(dev->d_direct)
+      return ntfs_direct_pread(dev->d_direct, pos, count, b);
+
+   while(total < count)
+   {
+      ssize_t n = pread(fd, (u8 *)b + total, count - total, pos + total);
+      if(n < 0)
+         return -1;
+      if(n == 0)
+         break;
+      total += n;
+   }
+   return total;
+}
+
+s64 ntfs_pread(ntfs_volume *vol, s64 pos, s64 count, void *b)
+{
+   if(vol->dev->d_cache)
+      return ntfs_cache_pread(vol->dev->d_cache, pos, count, b);
+   return ntfs_device_pread(vol->dev, pos, count, b);
+}
+
+/**
+ * ntfs_rl_pread - read a byte range of a non-resident attribute
+ *
+ * Walks @rl in order, so reading an attribute front to back only ever seeks
+ * forward on the device.  Holes and anything past the end of the runlist
+ * read back as zeroes.  Returns @count, or -1 if the device read failed.
+ */
+s64 ntfs_rl_pread(ntfs_volume *vol, const runlist_element *rl,
+      s64 pos, s64 count, void *b)
+{
+   u8 *buf = (u8 *)b;
+   s64 total = count;
+
+   for(; rl->length && count > 0; rl++)
+   {
+      s64 start = rl->vcn << vol->cluster_size_bits;
+      s64 len = rl->length << vol->cluster_size_bits;
+      if(pos >= start + len)
+         continue;
+      s64 ofs = pos - start;
+      s64 n = len - ofs < count ? len - ofs : count;
+      if(rl->lcn < 0)
+         memset(buf, 0, n);
+      else
+      {
+         /* Read ahead through the clusters of this run we need, no more */
+         if(vol->dev->d_cache)
+            ntfs_cache_hint(vol->dev->d_cache,
+                  rl->lcn + (ofs >> vol->cluster_size_bits),
+                  ((ofs & (vol->cluster_size - 1)) + n
+                   + vol->cluster_size - 1) >> vol->cluster_size_bits);
+         if(ntfs_pread(vol, (rl->lcn << vol->cluster_size_bits) + ofs,
+                  n, buf) != n)
+            return -1;
+      }
+      buf += n;
+      pos += n;
+      count -= n;
+   }
+   memset(buf, 0, count);
+   return total;
+}
+
+int ntfs_mst_post_read_fixup(void *b, u32 size)
+{
+   MFT_RECORD *m = (MFT_RECORD *)b;
+   u16 usa_ofs = m->usa_ofs;
+   u16 usa_count = m->usa_count;
+
+   if((usa_ofs & 1) || usa_count == 0
+         || (u32)usa_ofs + usa_count * 2 > size
+         || (u32)(usa_count - 1) * NTFS_BLOCK_SIZE != size)
       return -1;
+
+   u16 *usa = (u16 *)((u8 *)b + usa_ofs);
+   for(int i = 1; i < usa_count; i++)
+   {
+      u16 *pos = (u16 *)((u8 *)b + i * NTFS_BLOCK_SIZE - 2);
+      if(*pos != usa[0])
+         return -1;
    }
-   ntfs_volume *vol = (ntfs_volume *)malloc(sizeof(ntfs_volume));
-   if(vol == NULL)
+   for(int i = 1; i < usa_count; i++)
+      *(u16 *)((u8 *)b + i * NTFS_BLOCK_SIZE - 2) = usa[i];
+   return 0;
+}
+
+runlist_element *ntfs_decompress_runlist(const ATTR_RECORD *a)
+{
+   const u8 *buf = (const u8 *)a + a->mapping_pairs_offset;
+   const u8 *end = (const u8 *)a + a->length;
+   runlist_element *rl = NULL;
+   int n = 0, size = 0;
+   VCN vcn = a->lowest_vcn;
+   LCN lcn = 0;
+
+   if(a->mapping_pairs_offset >= a->length)
+      return NULL;
+   for(; buf < end && *buf; n++)
    {
-      fprintf(stderr, "[ERROR] Allocating memory for NTFS Volumne failed\n");
+      int b = *buf & 0xf;
+      int f = (*buf >> 4) & 0xf;
+      if(b == 0 || b > 8 || f > 8 || buf + b + f >= end)
+         goto err;
+      if(n + 1 >= size)
+      {
+         size = size ? size * 2 : 16;
+         runlist_element *r = realloc(rl, size * sizeof(*rl));
+         if(r == NULL)
+            goto err;
+         rl = r;
+      }
+      s64 length = (s8)buf[b];
+      for(int i = b - 1; i > 0; i--)
+         length = (length << 8) | buf[i];
+      if(length <= 0)
+         goto err;
+      rl[n].vcn = vcn;
+      rl[n].length = length;
+      if(f)
+      {
+         s64 delta = (s8)buf[b + f];
+         for(int i = b + f - 1; i > b; i--)
+            delta = (delta << 8) | buf[i];
+         lcn += delta;
+         if(lcn < 0)
+            goto err;
+         rl[n].lcn = lcn;
+      }
+      else
+         rl[n].lcn = LCN_HOLE;
+      vcn += length;
+      buf += b + f + 1;
+   }
+   if(rl == NULL && (rl = malloc(sizeof(*rl))) == NULL)
+      return NULL;
+   rl[n].vcn = vcn;
+   rl[n].lcn = LCN_ENOENT;
+   rl[n].length = 0;
+   return rl;
+err:
+   free(rl);
+   return NULL;
+}
+
+int ntfs_ucstombs(const ntfschar *ins, int ins_len, char **outs)
+{
+   char *out = malloc(ins_len * 3 + 1);
+   int o = 0;
+
+   if(out == NULL)
       return -1;
+   for(int i = 0; i < ins_len; i++)
+   {
+      u32 c = ins[i];
+      if(c >= 0xd800 && c < 0xdc00 && i + 1 < ins_len
+            && ins[i + 1] >= 0xdc00 && ins[i + 1] < 0xe000)
+         c = 0x10000 + ((c - 0xd800) << 10) + (ins[++i] - 0xdc00);
+      else if(c >= 0xd800 && c < 0xe000)
+         c = 0xfffd;	/* Unpaired, not valid UTF-8 on its own */
+      if(c < 0x80)
+         out[o++] = c;
+      else if(c < 0x800)
+      {
+         out[o++] = 0xc0 | (c >> 6);
+         out[o++] = 0x80 | (c & 0x3f);
+      }
+      else if(c < 0x10000)
+      {
+         out[o++] = 0xe0 | (c >> 12);
+         out[o++] = 0x80 | ((c >> 6) & 0x3f);
+         out[o++] = 0x80 | (c & 0x3f);
+      }
+      else
+      {
+         out[o++] = 0xf0 | (c >> 18);
+         out[o++] = 0x80 | ((c >> 12) & 0x3f);
+         out[o++] = 0x80 | ((c >> 6) & 0x3f);
+         out[o++] = 0x80 | (c & 0x3f);
+      }
    }
-   fill_ntfs_info(vol, boot_sector);
-   load_ntfs_mft(vol);
+   out[o] = '\0';
+   *outs = out;
+   return o;
+}
 
-   free(vol);
-   fclose(fp);
+time_t ntfs2utc(s64 ntfstime)
+{
+   return (ntfstime - NTFS_TIME_OFFSET) / 10000000;
+}
+
+struct ufile *alloc_ufile(u64 mft_no)
+{
+   struct ufile *file = calloc(1, sizeof(struct ufile));
+
+   if(file == NULL)
+      return NULL;
+   INIT_LIST_HEAD(&file->name);
+   INIT_LIST_HEAD(&file->data);
+   file->inode = mft_no;
+   return file;
+}
+
+/**
+ * ntfs_ufile_seqno - the sequence number references to @file carry
+ *
+ * NTFS bumps the sequence number of a record when it is freed, so the
+ * extension records and filenames of a deleted file refer to it with one
+ * less than its record holds.  A reference with any other sequence number
+ * is left over from an earlier file in the same record.
+ */
+u16 ntfs_ufile_seqno(const struct ufile *file)
+{
+   /* Freeing never makes it 0, and leaves a 0 alone */
+   if(file->in_use || file->seq_no == 0)
+      return file->seq_no;
+   return file->seq_no == 1 ? 0xffff : file->seq_no - 1;
+}
+
+void free_ufile(struct ufile *file)
+{
+   struct list_head *item, *tmp;
+
+   list_for_each_safe(item, tmp, &file->name)
+   {
+      struct filename *f = list_entry(item, struct filename, list);
+      free(f->uname);
+      free(f->name);
+      free(f->parent_name);
+      free(f);
+   }
+   list_for_each_safe(item, tmp, &file->data)
+   {
+      struct data *d = list_entry(item, struct data, list);
+      free(d->uname);
+      free(d->name);
+      free(d->runlist);
+      free(d->data);
+      free(d->path);
+      free(d->overlap);
+      free(d);
+   }
+   free(file->mft);
+   free(file);
+}
+
+void free_ntfs_mft(struct mft_table *files)
+{
+   for(long i = 0; i < files->nr; i++)
+      free_ufile(files->files[i]);
+   free(files->files);
+   files->files = NULL;
+   files->nr = 0;
+}
+
+static int get_filename(struct ufile *file, const ATTR_RECORD *a)
+{
+   const FILE_NAME_ATTR *attr;
+   struct filename *name;
+
+   if(a->non_resident || a->value_length < sizeof(FILE_NAME_ATTR)
+         || (u32)a->value_offset + a->value_length > a->length)
+      return -1;
+   attr = (const FILE_NAME_ATTR *)((const u8 *)a + a->value_offset);
+   if(sizeof(FILE_NAME_ATTR) + attr->file_name_length * sizeof(ntfschar)
+         > a->value_length)
+      return -1;
+
+   name = calloc(1, sizeof(struct filename));
+   if(name == NULL)
+      return -1;
+   name->uname_len = attr->file_name_length;
+   name->uname = malloc(name->uname_len * sizeof(ntfschar) + 1);
+   if(name->uname == NULL)
+   {
+      free(name);
+      return -1;
+   }
+   memcpy(name->uname, attr->file_name, name->uname_len * sizeof(ntfschar));
+   if(ntfs_ucstombs(name->uname, name->uname_len, &name->name) < 0)
+      name->name = NULL;
+   name->size_alloc = attr->allocated_size;
+   name->size_data = attr->data_size;
+   name->flags = attr->file_attributes;
+   name->date_c = ntfs2utc(attr->creation_time);
+   name->date_a = ntfs2utc(attr->last_data_change_time);
+   name->date_m = ntfs2utc(attr->last_mft_change_time);
+   name->date_r = ntfs2utc(attr->last_access_time);
+   name->name_space = attr->file_name_type;
+   name->parent_mref = attr->parent_directory;
+   if(name->size_data > file->max_size)
+      file->max_size = name->size_data;
+   list_add_tail(&name->list, &file->name);
+   return 0;
+}
+
+static int get_data(struct ufile *file, const ATTR_RECORD *a)
+{
+   struct data *data = calloc(1, sizeof(struct data));
+
+   if(data == NULL)
+      return -1;
+   data->resident = !a->non_resident;
+   data->compressed = (a->flags & ATTR_IS_COMPRESSED) != 0;
+   data->encrypted = (a->flags & ATTR_IS_ENCRYPTED) != 0;
+   if(a->name_length)
+   {
+      data->uname_len = a->name_length;
+      data->uname = malloc(data->uname_len * sizeof(ntfschar) + 1);
+      if(data->uname == NULL)
+         goto err;
+      memcpy(data->uname, (const u8 *)a + a->name_offset,
+            data->uname_len * sizeof(ntfschar));
+      if(ntfs_ucstombs(data->uname, data->uname_len, &data->name) < 0)
+         data->name = NULL;
+   }
+   if(data->resident)
+   {
+      if((u32)a->value_offset + a->value_length > a->length)
+         goto err;
+      data->size_data = a->value_length;
+      data->size_alloc = a->value_length;
+      data->size_init = a->value_length;
+      data->percent = 100;
+      data->data = malloc(a->value_length + 1);
+      if(data->data == NULL)
+         goto err;
+      memcpy(data->data, (const u8 *)a + a->value_offset, a->value_length);
+   }
+   else
+   {
+      data->size_alloc = a->allocated_size;
+      data->size_data = a->data_size;
+      data->size_init = a->initialized_size;
+      data->size_vcn = a->highest_vcn + 1;
+      data->runlist = ntfs_decompress_runlist(a);
+      if(data->runlist == NULL)
+         goto err;
+   }
+   if(data->size_data > file->max_size)
+      file->max_size = data->size_data;
+   list_add_tail(&data->list, &file->data);
+   return 0;
+err:
+   free(data->uname);
+   free(data->name);
+   free(data->data);
+   free(data);
+   return -1;
+}
+
+/**
+ * parse_mft_record - turn one (fixed up) mft record into a ufile
+ *
+ * Extension records are parsed the same way; the caller tells them apart by
+ * @m->base_mft_record and joins them to their base record later.
+ */
+struct ufile *parse_mft_record(ntfs_volume *vol, MFT_RECORD *m,
+      u64 mft_no)
+{
+   struct ufile *file = alloc_ufile(mft_no);
+   u32 end = m->bytes_in_use < vol->mft_record_size ?
+      m->bytes_in_use : vol->mft_record_size;
+   u32 ofs = m->attrs_offset;
+
+   if(file == NULL)
+      return NULL;
+   file->in_use = (m->flags & MFT_RECORD_IN_USE) != 0;
+   file->seq_no = m->sequence_number;
+   file->directory = (m->flags & MFT_RECORD_IS_DIRECTORY) != 0;
+
+   while(ofs + 8 <= end)
+   {
+      const ATTR_RECORD *a = (const ATTR_RECORD *)((u8 *)m + ofs);
+      if(a->type == AT_END || a->length < 16 || ofs + a->length > end)
+         break;
+      switch(a->type)
+      {
+      case AT_STANDARD_INFORMATION:
+         if(!a->non_resident
+               && a->value_length >= 4 * sizeof(s64)
+               && (u32)a->value_offset + a->value_length <= a->length)
+         {
+            const STANDARD_INFORMATION *si = (const STANDARD_INFORMATION *)
+               ((const u8 *)a + a->value_offset);
+            file->date = ntfs2utc(si->last_data_change_time);
+            file->date_c = ntfs2utc(si->creation_time);
+            file->date_a = file->date;
+            file->date_m = ntfs2utc(si->last_mft_change_time);
+            file->date_r = ntfs2utc(si->last_access_time);
+         }
+         break;
+      case AT_ATTRIBUTE_LIST:
+         file->attr_list = 1;
+         break;
+      case AT_FILE_NAME:
+         get_filename(file, a);
+         break;
+      case AT_DATA:
+         get_data(file, a);
+         break;
+      default:
+         break;
+      }
+      ofs += a->length;
+   }
+   return file;
+}
+
+static const ATTR_RECORD *find_attr(ntfs_volume *vol, MFT_RECORD *m,
+      ATTR_TYPES type)
+{
+   u32 ofs = m->attrs_offset;
+
+   while(ofs + 8 <= m->bytes_in_use && ofs + 8 <= vol->mft_record_size)
+   {
+      const ATTR_RECORD *a = (const ATTR_RECORD *)((u8 *)m + ofs);
+      if(a->type == AT_END || a->length < 16
+            || ofs + a->length > vol->mft_record_size)
+         break;
+      if(a->type == type && a->name_length == 0)
+         return a;
+      ofs += a->length;
+   }
+   return NULL;
+}
+
+static int read_mft_record(ntfs_volume *vol, const runlist_element *rl,
+      u64 mft_no, MFT_RECORD *m)
+{
+   int r = ntfs_mftmirr_record(vol, mft_no, m);
+
+   if(r <= 0)
+      return r;
+   if(ntfs_rl_pread(vol, rl, mft_no << vol->mft_record_size_bits,
+            vol->mft_record_size, m) < 0)
+      return -1;
+   if(m->magic != magic_FILE
+         || ntfs_mst_post_read_fixup(m, vol->mft_record_size) < 0)
+      return -1;
+   return 0;
+}
+
+static int rl_vcn_cmp(const void *a, const void *b)
+{
+   const runlist_element *x = a, *y = b;
+
+   return x->vcn < y->vcn ? -1 : x->vcn > y->vcn;
+}
+
+/**
+ * rl_merge - append the extent runlist @add to @rl
+ *
+ * Extents may turn up in any order, so the result is sorted by vcn again.
+ * @add is consumed.  Returns the merged runlist or NULL (and @rl is kept).
+ */
+static runlist_element *rl_merge(runlist_element *rl, runlist_element *add)
+{
+   int n = 0, m = 0;
+
+   while(rl[n].length)
+      n++;
+   while(add[m].length)
+      m++;
+   runlist_element *r = realloc(rl, (n + m + 1) * sizeof(*r));
+   if(r == NULL)
+      return NULL;
+   memcpy(r + n, add, m * sizeof(*r));
+   qsort(r, n + m, sizeof(*r), rl_vcn_cmp);
+   r[n + m].vcn = n + m ? r[n + m - 1].vcn + r[n + m - 1].length : 0;
+   r[n + m].lcn = LCN_ENOENT;
+   r[n + m].length = 0;
+   free(add);
+   return r;
+}
+
+/*
+ * $MFT's own $DATA may outgrow record 0, in which case the attribute list in
+ * record 0 points at the extension records holding the remaining extents.
+ * Those always live in the part of $MFT the first extent already maps.
+ */
+static int load_mft_extents(ntfs_volume *vol, MFT_RECORD *m0)
+{
+   const ATTR_RECORD *a = find_attr(vol, m0, AT_ATTRIBUTE_LIST);
+   runlist_element *rl = vol->mft_na->rl;
+   u8 *al = NULL;
+   u32 al_len;
+   int err = -1;
+
+   if(a == NULL)
+      return 0;
+   if(a->non_resident)
+   {
+      runlist_element *arl = ntfs_decompress_runlist(a);
+      al_len = a->data_size;
+      if(arl == NULL || (al = malloc(al_len)) == NULL
+            || ntfs_rl_pread(vol, arl, 0, al_len, al) < 0)
+      {
+         free(arl);
+         goto out;
+      }
+      free(arl);
+   }
+   else
+   {
+      al_len = a->value_length;
+      /* A list running past its attribute is skipped, not read */
+      if((u64)a->value_offset + al_len > a->length)
+      {
+         fprintf(stderr, "[WARN] $MFT has a damaged attribute list, only "
+               "its first extent is used\n");
+         return 0;
+      }
+      if((al = malloc(al_len)) == NULL)
+         goto out;
+      memcpy(al, (const u8 *)a + a->value_offset, al_len);
+   }
+
+   MFT_RECORD *m = malloc(vol->mft_record_size);
+   if(m == NULL)
+      goto out;
+   for(u32 ofs = 0; ofs + sizeof(ATTR_LIST_ENTRY) <= al_len;)
+   {
+      const ATTR_LIST_ENTRY *e = (const ATTR_LIST_ENTRY *)(al + ofs);
+      if(e->length < sizeof(ATTR_LIST_ENTRY))
+         break;
+      ofs += e->length;
+      if(e->type != AT_DATA || e->name_length || MREF(e->mft_reference) == 0)
+         continue;
+      if(read_mft_record(vol, rl, MREF(e->mft_reference), m) < 0)
+      {
+         fprintf(stderr, "[ERROR] Reading $MFT extent record %llu failed\n",
+               (unsigned long long)MREF(e->mft_reference));
+         continue;
+      }
+      const ATTR_RECORD *d = find_attr(vol, m, AT_DATA);
+      runlist_element *ext;
+      if(d == NULL || !d->non_resident
+            || (ext = ntfs_decompress_runlist(d)) == NULL)
+         continue;
+      runlist_element *r = rl_merge(rl, ext);
+      if(r == NULL)
+      {
+         free(ext);
+         break;
+      }
+      rl = r;
+   }
+   vol->mft_na->rl = rl;
+   free(m);
+   err = 0;
+out:
+   free(al);
+   return err;
+}
+
+static int load_mft_runlist(ntfs_volume *vol)
+{
+   MFT_RECORD *m = malloc(vol->mft_record_size);
+   runlist_element boot_rl[2] = {
+      { 0, vol->mft_lcn, (vol->mft_record_size + vol->cluster_size - 1)
+         >> vol->cluster_size_bits },
+      { 0, LCN_ENOENT, 0 },
+   };
+   const ATTR_RECORD *a;
+
+   if(m == NULL)
+      return -1;
+   boot_rl[1].vcn = boot_rl[0].length;
+   if(read_mft_record(vol, boot_rl, FILE_MFT, m) < 0)
+   {
+      fprintf(stderr, "[ERROR] $MFT record is damaged\n");
+      goto err;
+   }
+   a = find_attr(vol, m, AT_DATA);
+   if(a == NULL || !a->non_resident)
+   {
+      fprintf(stderr, "[ERROR] $MFT has no non-resident $DATA\n");
+      goto err;
+   }
+   vol->mft_na = calloc(1, sizeof(ntfs_attr));
+   if(vol->mft_na == NULL)
+      goto err;
+   vol->mft_na->type = AT_DATA;
+   vol->mft_na->allocated_size = a->allocated_size;
+   vol->mft_na->data_size = a->data_size;
+   vol->mft_na->initialized_size = a->initialized_size;
+   vol->mft_na->rl = ntfs_decompress_runlist(a);
+   if(vol->mft_na->rl == NULL)
+   {
+      fprintf(stderr, "[ERROR] $MFT runlist is corrupt\n");
+      goto err;
+   }
+   if(load_mft_extents(vol, m) < 0)
+      goto err;
+   free(m);
+   return 0;
+err:
+   free(m);
+   return -1;
+}
+
+/**
+ * load_ntfs_bitmap - locate the cluster allocation bitmap of the volume
+ *
+ * Only the runlist of $Bitmap/$DATA is kept in @vol->lcnbmp_na, readers
+ * fetch the part of the bitmap they need through ntfs_rl_pread().
+ */
+int load_ntfs_bitmap(ntfs_volume *vol)
+{
+   const ATTR_RECORD *a;
+   MFT_RECORD *m;
+
+   if(vol->lcnbmp_na)
+      return 0;
+   if(vol->mft_na == NULL && load_mft_runlist(vol) < 0)
+      return -1;
+   m = malloc(vol->mft_record_size);
+   if(m == NULL)
+      return -1;
+   if(read_mft_record(vol, vol->mft_na->rl, FILE_Bitmap, m) < 0
+         || (a = find_attr(vol, m, AT_DATA)) == NULL || !a->non_resident)
+   {
+      fprintf(stderr, "[ERROR] $Bitmap record is damaged\n");
+      free(m);
+      return -1;
+   }
+   vol->lcnbmp_na = calloc(1, sizeof(ntfs_attr));
+   if(vol->lcnbmp_na)
+   {
+      vol->lcnbmp_na->type = AT_DATA;
+      vol->lcnbmp_na->allocated_size = a->allocated_size;
+      vol->lcnbmp_na->data_size = a->data_size;
+      vol->lcnbmp_na->initialized_size = a->initialized_size;
+      vol->lcnbmp_na->rl = ntfs_decompress_runlist(a);
+   }
+   free(m);
+   if(vol->lcnbmp_na == NULL || vol->lcnbmp_na->rl == NULL)
+   {
+      fprintf(stderr, "[ERROR] $Bitmap runlist is corrupt\n");
+      free(vol->lcnbmp_na);
+      vol->lcnbmp_na = NULL;
+      return -1;
+   }
    return 0;
 }
 
-void load_ntfs_mft(ntfs_volume *vol)
+int ntfs_lcn_scan_init(struct lcn_scan *sc, ntfs_volume *vol)
+{
+   sc->vol = vol;
+   sc->start = 0;
+   sc->len = 0;
+   sc->buf = NULL;
+   if(load_ntfs_bitmap(vol) < 0)
+      return -1;
+   sc->buf = ntfs_io_buf_alloc(LCN_SCAN_WINDOW);
+   return sc->buf ? 0 : -1;
+}
+
+void ntfs_lcn_scan_free(struct lcn_scan *sc)
+{
+   free(sc->buf);
+   sc->buf = NULL;
+}
+
+/**
+ * ntfs_lcn_count_free - count the free clusters among @count from @lcn
+ *
+ * Clusters past the end of the volume count as in use.  Callers going
+ * through their runs in cluster order read $Bitmap once, front to back.
+ * Returns the number of free clusters or -1 if $Bitmap can't be read.
+ */
+s64 ntfs_lcn_count_free(struct lcn_scan *sc, LCN lcn, s64 count)
+{
+   ntfs_volume *vol = sc->vol;
+   s64 bmp_size = (vol->nr_clusters + 7) >> 3;
+   s64 nr_free = 0;
+   LCN stop;
+
+   if(lcn < 0 || lcn >= vol->nr_clusters || count <= 0)
+      return 0;
+   stop = count < vol->nr_clusters - lcn ? lcn + count : vol->nr_clusters;
+   while(lcn < stop)
+   {
+      s64 byte = lcn >> 3;
+      if(byte < sc->start || byte >= sc->start + sc->len)
+      {
+         s64 len = bmp_size - byte < LCN_SCAN_WINDOW ?
+            bmp_size - byte : LCN_SCAN_WINDOW;
+         if(ntfs_rl_pread(vol, vol->lcnbmp_na->rl, byte, len, sc->buf) < 0)
+            return -1;
+         sc->start = byte;
+         sc->len = len;
+      }
+      LCN end = (sc->start + sc->len) << 3;
+      const u8 *b = sc->buf - sc->start;
+      if(end > stop)
+         end = stop;
+      for(; lcn < end && (lcn & 63); lcn++)
+         nr_free += !(b[lcn >> 3] & (1 << (lcn & 7)));
+      for(; lcn + 64 <= end; lcn += 64)
+      {
+         u64 w;
+         memcpy(&w, b + (lcn >> 3), 8);
+         nr_free += 64 - __builtin_popcountll(w);
+      }
+      for(; lcn < end; lcn++)
+         nr_free += !(b[lcn >> 3] & (1 << (lcn & 7)));
+   }
+   return nr_free;
+}
+
+/* A run of a deleted stream, for visiting $Bitmap in cluster order */
+struct score_run {
+   LCN  lcn;
+   s64  length;
+   long stream;
+};
+
+struct score_stream {
+   struct data *d;
+   s64         nr_free;
+   s64         total;
+};
+
+static int score_run_cmp(const void *a, const void *b)
+{
+   const struct score_run *x = a, *y = b;
+
+   return x->lcn < y->lcn ? -1 : x->lcn > y->lcn;
+}
+
+/**
+ * score_ntfs_mft - work out how much of each deleted stream is recoverable
+ *
+ * That is the share of its clusters $Bitmap still has free.  The runs of
+ * all deleted streams are sorted by cluster first so that $Bitmap is read
+ * once, front to back.  Resident streams are always whole.
+ */
+void score_ntfs_mft(ntfs_volume *vol, const struct mft_table *files)
+{
+   struct score_stream *st = NULL;
+   struct score_run *runs = NULL;
+   long nr_st = 0, nr_runs = 0, i;
+   struct list_head *ditem;
+   struct lcn_scan sc;
+
+   for(i = 0; i < files->nr; i++)
+   {
+      struct ufile *file = files->files[i];
+      if(file->in_use)
+         continue;
+      list_for_each(ditem, &file->data)
+      {
+         struct data *d = list_entry(ditem, struct data, list);
+         if(d->resident || d->runlist == NULL)
+            continue;
+         nr_st++;
+         for(runlist_element *rl = d->runlist; rl->length; rl++)
+            nr_runs += rl->lcn >= 0;
+      }
+   }
+   if(nr_st == 0 || ntfs_lcn_scan_init(&sc, vol) < 0)
+      return;
+   st = malloc(nr_st * sizeof(*st));
+   runs = malloc((nr_runs ? nr_runs : 1) * sizeof(*runs));
+   if(st == NULL || runs == NULL)
+      goto out;
+   nr_st = nr_runs = 0;
+   for(i = 0; i < files->nr; i++)
+   {
+      struct ufile *file = files->files[i];
+      if(file->in_use)
+         continue;
+      list_for_each(ditem, &file->data)
+      {
+         struct data *d = list_entry(ditem, struct data, list);
+         if(d->resident || d->runlist == NULL)
+            continue;
+         for(runlist_element *rl = d->runlist; rl->length; rl++)
+            if(rl->lcn >= 0)
+            {
+               runs[nr_runs].lcn = rl->lcn;
+               runs[nr_runs].length = rl->length;
+               runs[nr_runs++].stream = nr_st;
+            }
+         st[nr_st].d = d;
+         st[nr_st].nr_free = 0;
+         st[nr_st++].total = 0;
+      }
+   }
+   qsort(runs, nr_runs, sizeof(*runs), score_run_cmp);
+   for(i = 0; i < nr_runs; i++)
+   {
+      s64 n = ntfs_lcn_count_free(&sc, runs[i].lcn, runs[i].length);
+      if(n < 0)
+         goto out;
+      st[runs[i].stream].nr_free += n;
+      st[runs[i].stream].total += runs[i].length;
+   }
+   for(i = 0; i < nr_st; i++)
+      st[i].d->percent = st[i].total ?
+         st[i].nr_free * 100 / st[i].total : 100;
+out:
+   free(st);
+   free(runs);
+   ntfs_lcn_scan_free(&sc);
+}
+
+static int extent_cmp(const void *a, const void *b)
+{
+   const struct mft_extent *x = a, *y = b;
+
+   if(x->base != y->base)
+      return x->base < y->base ? -1 : 1;
+   return x->file->inode < y->file->inode ? -1 :
+      x->file->inode > y->file->inode;
+}
+
+static struct data *find_stream(struct ufile *file, const struct data *d)
+{
+   struct list_head *item;
+
+   list_for_each(item, &file->data)
+   {
+      struct data *s = list_entry(item, struct data, list);
+      if(s->uname_len == d->uname_len && !s->resident && !d->resident
+            && (d->uname_len == 0 || !memcmp(s->uname, d->uname,
+                  d->uname_len * sizeof(ntfschar))))
+         return s;
+   }
+   return NULL;
+}
+
+/**
+ * ntfs_join_stream - add stream @d to @file, joined with its other extents
+ *
+ * If @file has a non-resident stream of the same name already, the runs
+ * of @d are merged into it by vcn and @d is freed.  Returns the stream
+ * that holds the runs of @d now, or NULL if they could not be merged (and
+ * @d is left alone).
+ */
+struct data *ntfs_join_stream(struct ufile *file, struct data *d)
+{
+   struct data *s = find_stream(file, d);
+
+   if(s == NULL || s->runlist == NULL || d->runlist == NULL)
+   {
+      list_add_tail(&d->list, &file->data);
+      return d;
+   }
+   /* Sizes are only valid in the extent starting at vcn 0 */
+   int first = d->runlist[0].vcn == 0;
+   runlist_element *r = rl_merge(s->runlist, d->runlist);
+   if(r == NULL)
+      return NULL;
+   s->runlist = r;
+   d->runlist = NULL;
+   if(first)
+   {
+      s->size_alloc = d->size_alloc;
+      s->size_data = d->size_data;
+      s->size_init = d->size_init;
+   }
+   if(d->size_vcn > s->size_vcn)
+      s->size_vcn = d->size_vcn;
+   free(d->uname);
+   free(d->name);
+   free(d);
+   return s;
+}
+
+/*
+ * Move everything parsed out of extension record @ext into its base @file.
+ * Extra $FILE_NAMEs (hard links) are appended, $DATA extents are merged into
+ * the matching stream of the base record by vcn.
+ */
+static void join_extent(struct ufile *file, struct ufile *ext)
+{
+   struct list_head *item, *tmp;
+
+   list_splice(&ext->name, file->name.prev);
+   INIT_LIST_HEAD(&ext->name);
+   list_for_each_safe(item, tmp, &ext->data)
+   {
+      struct data *d = list_entry(item, struct data, list);
+      list_del(item);
+      if(ntfs_join_stream(file, d) == NULL)
+         list_add_tail(item, &ext->data);
+   }
+   if(ext->max_size > file->max_size)
+      file->max_size = ext->max_size;
+   file->attr_list = 1;
+}
+
+/**
+ * join_extents - attach collected extension records to their base ufiles
+ *
+ * @files is in mft record order straight from the sweep, so sorting the
+ * extents by base record turns the join into a single merge pass.  Extents
+ * whose base record is gone, or now holds another file (the sequence
+ * numbers disagree), are kept as files of their own, merged into @files in
+ * record order.  Returns the number of extents joined to a base
+ * record.
+ */
+static long join_extents(struct mft_table *files, struct mft_extent *ext,
+      long nr_ext)
+{
+   struct ufile *base;
+   long i, pos = 0, nr_orphans = 0;
+
+   if(nr_ext == 0)
+      return 0;
+   qsort(ext, nr_ext, sizeof(*ext), extent_cmp);
+   for(i = 0; i < nr_ext; i++)
+   {
+      while(pos < files->nr && (u64)files->files[pos]->inode < ext[i].base)
+         pos++;
+      base = pos < files->nr ? files->files[pos] : NULL;
+      if(base && (u64)base->inode == ext[i].base
+            && ntfs_ufile_seqno(base) == ext[i].seq)
+      {
+         join_extent(base, ext[i].file);
+         free_ufile(ext[i].file);
+      }
+      else
+      {
+         ext[i].file->attr_list = 1;
+         ext[i].base = ext[i].file->inode;
+         ext[nr_orphans++] = ext[i];
+      }
+   }
+   if(nr_orphans == 0)
+      return nr_ext;
+
+   struct ufile **tab = malloc((files->nr + nr_orphans) * sizeof(*tab));
+   if(tab == NULL)
+   {
+      for(i = 0; i < nr_orphans; i++)
+         free_ufile(ext[i].file);
+      return nr_ext - nr_orphans;
+   }
+   qsort(ext, nr_orphans, sizeof(*ext), extent_cmp);
+   long n = 0;
+   pos = 0;
+   for(i = 0; i < nr_orphans; i++)
+   {
+      while(pos < files->nr && files->files[pos]->inode < ext[i].file->inode)
+         tab[n++] = files->files[pos++];
+      tab[n++] = ext[i].file;
+   }
+   while(pos < files->nr)
+      tab[n++] = files->files[pos++];
+   free(files->files);
+   files->files = tab;
+   files->nr = n;
+   return nr_ext - nr_orphans;
+}
+
+static int ufile_inode_cmp(const void *a, const void *b)
+{
+   const long long *inode = a;
+   const struct ufile *file = *(struct ufile * const *)b;
+
+   return *inode < file->inode ? -1 : *inode > file->inode;
+}
+
+/*
+ * Pick a preferred name for every file (Win32 over DOS) and resolve the
+ * name of its parent directory from the records we already have in memory.
+ */
+static void resolve_names(struct mft_table *files)
+{
+   struct list_head *n;
+
+   for(long i = 0; i < files->nr; i++)
+   {
+      struct ufile *file = files->files[i];
+      struct filename *pref = NULL;
+      list_for_each(n, &file->name)
+      {
+         struct filename *f = list_entry(n, struct filename, list);
+         if(pref == NULL || pref->name_space == FILE_NAME_DOS)
+            pref = f;
+      }
+      file->pref_name = pref ? pref->name : NULL;
+   }
+
+   for(long i = 0; i < files->nr; i++)
+   {
+      struct ufile *file = files->files[i];
+      list_for_each(n, &file->name)
+      {
+         struct filename *f = list_entry(n, struct filename, list);
+         long long parent = MREF(f->parent_mref);
+         struct ufile **p = bsearch(&parent, files->files, files->nr,
+               sizeof(*files->files), ufile_inode_cmp);
+         if(p && (*p)->pref_name
+               && ntfs_ufile_seqno(*p) == MSEQNO(f->parent_mref))
+            f->parent_name = strdup((*p)->pref_name);
+         if(f->name == file->pref_name)
+            file->pref_pname = f->parent_name;
+      }
+   }
+}
+
+/**
+ * ntfs_mft_cursor_init - get ready to read the mft records of @vol in order
+ * @chunk:	bytes of $MFT read per request, 0 for MFT_SCAN_CHUNK
+ * @start:	first record to return
+ *
+ * The cursor holds one chunk of $MFT at a time; records it returns point
+ * into that buffer and stay valid until the next chunk is read.
+ */
+int ntfs_mft_cursor_init(struct mft_cursor *c, ntfs_volume *vol,
+      size_t chunk, u64 start)
 {
+   memset(c, 0, sizeof(*c));
+   if(vol->mft_na == NULL && load_mft_runlist(vol) < 0)
+      return -1;
+   if(chunk == 0)
+      chunk = MFT_SCAN_CHUNK;
+   /* Whole records only */
+   if(chunk < vol->mft_record_size)
+      chunk = vol->mft_record_size;
+   chunk &= ~((size_t)vol->mft_record_size - 1);
+   c->buf = ntfs_io_buf_alloc(chunk);
+   if(c->buf == NULL)
+      return -1;
+   c->vol = vol;
+   c->size = chunk;
+   c->next = start;
+   c->end = UINT64_MAX;
+   return 0;
+}
+
+/**
+ * ntfs_mft_cursor_next - the next record that passes the fixup check
+ * @mft_no:	set to its record number
+ *
+ * Returns NULL at the end of $MFT or on a read error, which sets @c->err,
+ * and with @c->stop_at_chunk_end set also where the next record would have
+ * to be read; clear it and call again to go on.
+ */
+MFT_RECORD *ntfs_mft_cursor_next(struct mft_cursor *c, u64 *mft_no)
+{
+   ntfs_volume *vol = c->vol;
+   s64 mft_size = vol->mft_na->initialized_size;
+
+   while(!c->err)
+   {
+      s64 ofs = (s64)c->next << vol->mft_record_size_bits;
+      if(ofs >= mft_size || c->next >= c->end)
+         return NULL;
+      if(ofs < c->pos || ofs >= c->pos + c->len)
+      {
+         if(c->stop_at_chunk_end)
+            return NULL;
+         s64 count = mft_size - ofs < (s64)c->size ?
+            mft_size - ofs : (s64)c->size;
+         if(ntfs_rl_pread(vol, vol->mft_na->rl, ofs, count, c->buf) < 0)
+         {
+            fprintf(stderr, "[ERROR] Reading $MFT at offset %lld failed\n",
+                  (long long)ofs);
+            c->err = -1;
+            return NULL;
+         }
+         c->pos = ofs;
+         c->len = count;
+      }
+      MFT_RECORD *m = (MFT_RECORD *)(c->buf + (ofs - c->pos));
+      if(ofs + vol->mft_record_size > c->pos + c->len)
+         return NULL;
+      *mft_no = c->next++;
+      /* Mirrored records come from whichever copy was intact; the
+         check has already reported those damaged in both */
+      int r = ntfs_mftmirr_record(vol, *mft_no, m);
+      if(r == 0)
+         return m;
+      if(r < 0)
+         continue;
+      if(m->magic != magic_FILE)
+         continue;
+      if(ntfs_mst_post_read_fixup(m, vol->mft_record_size) < 0)
+      {
+         c->nr_bad++;
+         continue;
+      }
+      return m;
+   }
+   return NULL;
+}
+
+/**
+ * ntfs_mft_cursor_seek - continue with record @mft_no
+ */
+void ntfs_mft_cursor_seek(struct mft_cursor *c, u64 mft_no)
+{
+   c->next = mft_no;
+   /* The buffer holds fixed up records, read it again if we come back */
+   c->len = 0;
+}
+
+void ntfs_mft_cursor_free(struct mft_cursor *c)
+{
+   free(c->buf);
+   c->buf = NULL;
+}
+
+/**
+ * ntfs_mft_sweep - parse every mft record of @vol, front to back
+ *
+ * $MFT is read following its runlist in MFT_SCAN_CHUNK pieces.  Each record
+ * that passes the fixup is parsed and handed to @fn together with the
+ * reference to its base record (0 for base records); @fn owns the ufile
+ * from then on and returns non-zero to stop the sweep.  A piece that
+ * cannot be read is reported and skipped, as load_ntfs_mft() does.
+ * Returns the number of records that failed the fixup check, or -1 on
+ * error.
+ */
+long ntfs_mft_sweep(ntfs_volume *vol,
+      int (*fn)(struct ufile *, u64, void *), void *arg)
+{
+   struct mft_cursor c;
+   MFT_RECORD *m;
+   u64 mft_no;
+   int stop = 0;
+
+   if(ntfs_mft_cursor_init(&c, vol, 0, 0) < 0)
+      return -1;
+   while(!stop)
+   {
+      while(!stop && (m = ntfs_mft_cursor_next(&c, &mft_no)))
+      {
+         struct ufile *file = parse_mft_record(vol, m, mft_no);
+         stop = file && fn(file, m->base_mft_record, arg);
+      }
+      if(!c.err)
+         break;
+      c.err = 0;
+      ntfs_mft_cursor_seek(&c, c.next + (c.size >> vol->mft_record_size_bits));
+   }
+   ntfs_mft_cursor_free(&c);
+
+   if(c.nr_bad)
+      fprintf(stderr, "[WARN] %ld mft records failed the fixup check\n",
+            c.nr_bad);
+   return c.nr_bad;
+}
+
+/*
+ * Push @p on the stack of finished parts.  Workers never wait for each
+ * other; the order parts arrive in does not matter, load_ntfs_mft() puts
+ * them back in chunk order.
+ */
+static void publish_part(struct mft_load *job, struct mft_part *p)
+{
+   p->next = __atomic_load_n(&job->parts, __ATOMIC_RELAXED);
+   while(!__atomic_compare_exchange_n(&job->parts, &p->next, p, 1,
+            __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+      ;
+}
+
+/* Read and parse chunk @chunk with @c, NULL if there is no memory for it */
+static struct mft_part *load_chunk(struct mft_load *job, struct mft_cursor *c,
+      u64 chunk)
+{
+   struct mft_part *p = malloc(sizeof(*p)
+         + job->per_chunk * sizeof(p->rec[0]));
+   MFT_RECORD *m;
+   u64 mft_no;
+
+   if(p == NULL)
+      return NULL;
+   p->chunk = chunk;
+   p->nr = 0;
+   ntfs_mft_cursor_seek(c, chunk * job->per_chunk);
+   c->end = c->next + job->per_chunk;
+   while((m = ntfs_mft_cursor_next(c, &mft_no)))
+   {
+      struct ufile *file = parse_mft_record(job->vol, m, mft_no);
+      if(file == NULL)
+         continue;
+      p->rec[p->nr].base = MREF(m->base_mft_record);
+      p->rec[p->nr].seq = MSEQNO(m->base_mft_record);
+      p->rec[p->nr++].file = file;
+   }
+   /* A chunk that could not be read is reported, the rest go on */
+   c->err = 0;
+   return p;
+}
+
+/*
+ * A worker that runs out of memory stops; the chunk it had taken is left
+ * to load_missing(), the others to the workers still going.
+ */
+static void *load_thread(void *arg)
+{
+   struct mft_load *job = arg;
+   struct mft_cursor c;
+   u64 chunk;
+
+   if(ntfs_mft_cursor_init(&c, job->vol, MFT_SCAN_CHUNK, 0) < 0)
+      return NULL;
+   while((chunk = __atomic_fetch_add(&job->next_chunk, 1, __ATOMIC_RELAXED))
+         < job->nr_chunks)
+   {
+      struct mft_part *p = load_chunk(job, &c, chunk);
+      if(p == NULL)
+         break;
+      publish_part(job, p);
+   }
+   __atomic_fetch_add(&job->nr_bad, c.nr_bad, __ATOMIC_RELAXED);
+   ntfs_mft_cursor_free(&c);
+   return NULL;
+}
+
+/*
+ * Read the chunks no worker published on the calling thread, once the
+ * workers are done and their memory is back.  Returns -1, having said
+ * why, if one cannot be read here either.
+ */
+static int load_missing(struct mft_load *job)
+{
+   u8 *have = calloc(job->nr_chunks ? job->nr_chunks : 1, 1);
+   struct mft_cursor c;
+   struct mft_part *p;
+   int open = 0, err = 0;
+
+   if(have == NULL)
+   {
+      fprintf(stderr, "[ERROR] Allocating memory for the mft records "
+            "failed\n");
+      return -1;
+   }
+   for(p = job->parts; p; p = p->next)
+      have[p->chunk] = 1;
+   for(u64 i = 0; i < job->nr_chunks && err == 0; i++)
+   {
+      if(have[i])
+         continue;
+      if(!open && ntfs_mft_cursor_init(&c, job->vol, MFT_SCAN_CHUNK, 0) < 0)
+      {
+         fprintf(stderr, "[ERROR] Allocating a buffer for $MFT failed\n");
+         err = -1;
+         break;
+      }
+      open = 1;
+      p = load_chunk(job, &c, i);
+      if(p == NULL)
+      {
+         fprintf(stderr, "[ERROR] Allocating memory for mft records "
+               "%llu to %llu failed\n",
+               (unsigned long long)(i * job->per_chunk),
+               (unsigned long long)((i + 1) * job->per_chunk - 1));
+         err = -1;
+      }
+      else
+         publish_part(job, p);
+   }
+   if(open)
+   {
+      job->nr_bad += c.nr_bad;
+      ntfs_mft_cursor_free(&c);
+   }
+   free(have);
+   return err;
+}
+
+/*
+ * Lay the published parts out by chunk, which puts every record in mft
+ * record order: base records into @files, extension records into @ext.
+ */
+static int gather_parts(struct mft_load *job, struct mft_table *files,
+      struct mft_extent **ext, long *nr_ext)
+{
+   struct mft_part **by_chunk = calloc(job->nr_chunks ? job->nr_chunks : 1,
+         sizeof(*by_chunk));
+   struct mft_part *p, *next;
+   long nr_base = 0, nr_parts = 0;
+   u64 i;
+
+   for(p = job->parts; p; p = next)
+   {
+      next = p->next;
+      if(by_chunk)
+         by_chunk[p->chunk] = p;
+      for(long r = 0; r < p->nr; r++)
+      {
+         if(p->rec[r].base)
+            (*nr_ext)++;
+         else
+            nr_base++;
+      }
+      nr_parts++;
+   }
+   if(by_chunk)
+   {
+      files->files = malloc((nr_base ? nr_base : 1) * sizeof(*files->files));
+      *ext = malloc((*nr_ext ? *nr_ext : 1) * sizeof(**ext));
+   }
+   if(by_chunk == NULL || files->files == NULL || *ext == NULL
+         || (u64)nr_parts != job->nr_chunks)
+   {
+      for(p = job->parts; p; p = next)
+      {
+         next = p->next;
+         for(long r = 0; r < p->nr; r++)
+            free_ufile(p->rec[r].file);
+         free(p);
+      }
+      free(by_chunk);
+      free(files->files);
+      files->files = NULL;
+      free(*ext);
+      *ext = NULL;
+      return -1;
+   }
+   *nr_ext = 0;
+   for(i = 0; i < job->nr_chunks; i++)
+   {
+      p = by_chunk[i];
+      for(long r = 0; r < p->nr; r++)
+      {
+         if(p->rec[r].base)
+            (*ext)[(*nr_ext)++] = p->rec[r];
+         else
+            files->files[files->nr++] = p->rec[r].file;
+      }
+      free(p);
+   }
+   free(by_chunk);
+   return 0;
+}
+
+/**
+ * load_ntfs_mft - read every mft record of the volume into @files
+ *
+ * $MFT is cut into MFT_SCAN_CHUNK pieces that @nr_threads workers take in
+ * turn, each following the runlist to read and parse whole chunks.  A
+ * worker collects its records in a part per chunk and publishes it without
+ * taking a lock; once all are done the parts are laid out in chunk order,
+ * which is mft record order, as one array.  Extension records are not
+ * resolved while sweeping (their base record may be in another worker's
+ * chunk); they are collected keyed by base record and joined afterwards.
+ * Returns the number of files, or -1 on error.
+ */
+int load_ntfs_mft(ntfs_volume *vol, struct mft_table *files, int nr_threads)
+{
+   struct mft_load job = { vol, 0, 0, 0, NULL, 0 };
+   struct mft_extent *ext = NULL;
+   long nr_ext = 0;
+   pthread_t *threads;
+   int i;
+
+   files->files = NULL;
+   files->nr = 0;
+   if(vol->mft_na == NULL && load_mft_runlist(vol) < 0)
+      return -1;
+   s64 nr_records = vol->mft_na->initialized_size >> vol->mft_record_size_bits;
+   job.per_chunk = MFT_SCAN_CHUNK >> vol->mft_record_size_bits;
+   if(job.per_chunk == 0)
+      job.per_chunk = 1;
+   job.nr_chunks = (nr_records + job.per_chunk - 1) / job.per_chunk;
+
+   if(nr_threads < 1)
+      nr_threads = 1;
+   threads = calloc(nr_threads, sizeof(*threads));
+   for(i = 0; threads && i < nr_threads; i++)
+      if(pthread_create(&threads[i], NULL, load_thread, &job) != 0)
+         break;
+   if(threads == NULL || i == 0)
+      load_thread(&job);
+   while(i-- > 0)
+      pthread_join(threads[i], NULL);
+   free(threads);
+
+   int err = load_missing(&job);
+   if(job.nr_bad)
+      fprintf(stderr, "[WARN] %ld mft records failed the fixup check\n",
+            job.nr_bad);
+   if(gather_parts(&job, files, &ext, &nr_ext) < 0)
+   {
+      if(err == 0)
+         fprintf(stderr, "[ERROR] Allocating memory for the mft records "
+               "failed\n");
+      return -1;
+   }
+   long nr_joined = join_extents(files, ext, nr_ext);
+   free(ext);
+   resolve_names(files);
+
+   printf("MFT SCAN INFO\n");
+   printf("--------------------------------------------\n");
+   printf(" [INFO] MFT records: %lld\n", (long long)nr_records);
+   printf(" [INFO] Files: %ld\n", files->nr);
+   printf(" [INFO] Extension records joined: %ld\n", nr_joined);
+   printf("\n");
+   return files->nr;
+}
+
+void list_ntfs_header(void)
+{
+   printf("Inode    Flags  Date              Size          Rec%%  Name\n");
+   printf("--------------------------------------------\n");
+}
+
+/*
+ * The recoverable share of a file is that of its unnamed data stream, and
+ * so is the O flag telling that other streams claim some of its clusters.
+ */
+void list_ntfs_file(const struct ufile *file)
+{
+   struct list_head *item;
+   char date[32] = "-";
+   int percent = 0, overlap = 0;
+
+   list_for_each(item, &file->data)
+   {
+      const struct data *d = list_entry(item, struct data, list);
+      if(d->name == NULL)
+      {
+         percent = d->percent;
+         overlap = d->nr_overlap > 0;
+         break;
+      }
+   }
+   if(file->date)
+      strftime(date, sizeof(date), "%Y-%m-%d %H:%M", gmtime(&file->date));
+   printf("%-8lld %c%c%c    %-17s %-13lld %3d%%  %s%s%s\n", file->inode,
+         file->directory ? 'D' : 'F', file->attr_list ? 'A' : '-',
+         overlap ? 'O' : '-',
+         date, file->max_size, percent,
+         file->pref_pname ? file->pref_pname : "",
+         file->pref_pname ? "/" : "",
+         file->pref_name ? file->pref_name : "<none>");
 }
 
 void fill_ntfs_info(ntfs_volume *vol, NTFS_BOOT_SECTOR s)
@@ -39,37 +1596,33 @@ void fill_ntfs_info(ntfs_volume *vol, NTFS_BOOT_SECTOR s)
    BIOS_PARAMETER_BLOCK b = s.bpb;
 
    vol->sector_size = b.bytes_per_sector;
+   vol->sector_size_bits = ffs(vol->sector_size) - 1;
    vol->cluster_size = b.bytes_per_sector * b.sectors_per_cluster;
+   vol->cluster_size_bits = ffs(vol->cluster_size) - 1;
    vol->nr_clusters = s.number_of_sectors / b.sectors_per_cluster;
    vol->mft_lcn = s.mft_lcn;
    vol->mftmirr_lcn = s.mftmirr_lcn;
-   vol->mft_record_size = s.clusters_per_mft_record * vol->cluster_size;
-   vol->indx_record_size = s.clusters_per_index_record * vol->cluster_size;
+   /* Negative means 2^-n bytes rather than n clusters */
+   if(s.clusters_per_mft_record < 0)
+      vol->mft_record_size = 1U << -s.clusters_per_mft_record;
+   else
+      vol->mft_record_size = s.clusters_per_mft_record * vol->cluster_size;
+   vol->mft_record_size_bits = ffs(vol->mft_record_size) - 1;
+   if(s.clusters_per_index_record < 0)
+      vol->indx_record_size = 1U << -s.clusters_per_index_record;
+   else
+      vol->indx_record_size = s.clusters_per_index_record * vol->cluster_size;
+   vol->indx_record_size_bits = ffs(vol->indx_record_size) - 1;
+   if(vol->cluster_size <= 4 * vol->mft_record_size)
+      vol->mftmirr_size = 4;
+   else
+      vol->mftmirr_size = vol->cluster_size / vol->mft_record_size;
    vol->mft_zone_start = 0;
    vol->mft_zone_pos = vol->mft_lcn;
    vol->mft_zone_end = vol->mft_lcn + (vol->nr_clusters >> 3); //12.5%
    vol->data1_zone_pos = vol->mft_zone_end;
    vol->data2_zone_pos = 0;
    vol->mft_data_pos = 24; // MFT Record 24
-
-   printf("NTFS BOOT SECTOR INFO\n");
-   printf("--------------------------------------------\n");
-   printf(" [INFO] Number of Sectors: %lld\n", s.number_of_sectors);
-   printf(" [INFO] Cluster location of MFT Data: %lld\n", s.mft_lcn);
-   printf(" [INFO] Cluster location of MFT copy: %lld\n", s.mftmirr_lcn);
-   printf(" [INFO] Clusters per MFT Record: %d\n", s.clusters_per_mft_record);
-   printf(" [INFO] Clusters per Index Record: %d\n", s.clusters_per_index_record);
-   printf(" [INFO] Boot Sector Checksum: 0x%08X\n", s.checksum);
-   printf("\n");
-
-   printf("BIOS PARAMETER BLOCK INFO\n");
-   printf("--------------------------------------------\n");
-   printf(" [INFO] Bytes per Sector: %d\n", b.bytes_per_sector);
-   printf(" [INFO] Sectors per Cluster: %d\n", b.sectors_per_cluster);
-   printf(" [INFO] MFT zone size: %d\n", b.sectors_per_cluster*s.number_of_sectors>>3); //12.5%
-   printf(" [INFO] Data1 Zone Position: 0x%08X\n", vol->data1_zone_pos);
-   printf(" [INFO] Data2 Zone Position: 0x%08X\n", vol->data2_zone_pos);
-
-   printf("\n");
+   for(int i = 0; i < 512; i++)
+      INIT_LIST_HEAD(&vol->inode_cache[i]);
 }
-
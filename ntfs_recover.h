@@ -2,6 +2,8 @@
 #include <stdlib.h>
 #include "type.h"
 #include "list.h"
+#include "hash.h"
+#include "mftmirr.h"
 
 /* The NTFS oem_id "NTFS    " */
 #define NTFS_SB_MAGIC	const_cpu_to_u64(0x202020205346544eULL)
@@ -293,6 +295,59 @@ typedef struct {
 } __attribute__((__packed__)) MFT_RECORD;
 
 
+/**
+ * enum NTFS_SYSTEM_FILES - System files mft record numbers.
+ *
+ * All these files are always marked as used in the bitmap attribute of the
+ * mft; presumably in order to avoid accidental allocation for random other
+ * mft records. Also, the sequence number for each of the system files is
+ * always equal to their mft record number and it is never modified.
+ */
+typedef enum {
+	FILE_MFT       = 0,	/* Master file table (mft). Data attribute
+				   contains the entries and bitmap attribute
+				   records which ones are in use (bit==1). */
+	FILE_MFTMirr   = 1,	/* Mft mirror: copy of first four mft records
+				   in data attribute. If cluster size > 4kiB,
+				   copy of first N mft records, with
+					N = cluster_size / mft_record_size. */
+	FILE_LogFile   = 2,	/* Journalling log in data attribute. */
+	FILE_Volume    = 3,	/* Volume name attribute and volume information
+				   attribute (flags and ntfs version). */
+	FILE_AttrDef   = 4,	/* Array of attribute definitions in data
+				   attribute. */
+	FILE_root      = 5,	/* Root directory. */
+	FILE_Bitmap    = 6,	/* Allocation bitmap of all clusters (lcns) in
+				   data attribute. */
+	FILE_Boot      = 7,	/* Boot sector (always at cluster 0) in data
+				   attribute. */
+	FILE_BadClus   = 8,	/* Contains all bad clusters in the non-resident
+				   data attribute. */
+	FILE_Secure    = 9,	/* Shared security descriptors in data attribute
+				   and two indexes into the descriptors. */
+	FILE_UpCase    = 10,	/* Uppercase equivalents of all 65536 Unicode
+				   characters in data attribute. */
+	FILE_Extend    = 11,	/* Directory containing other system files (eg.
+				   $ObjId, $Quota, $Reparse and $UsnJrnl). */
+	FILE_first_user = 16,	/* First inode for user files. */
+} NTFS_SYSTEM_FILES;
+
+/* Size of the blocks protected by the update sequence array. */
+#define NTFS_BLOCK_SIZE		512
+#define NTFS_BLOCK_SIZE_BITS	9
+
+/*
+ * An mft reference is the mft record number in the low 48 bits and the
+ * sequence number of the record in the high 16 bits.
+ */
+#define MFT_REF_MASK	0x0000ffffffffffffULL
+#define MREF(x)		((u64)((x) & MFT_REF_MASK))
+#define MSEQNO(x)	((u16)(((x) >> 48) & 0xffff))
+
+/* Number of 100ns intervals between 1601-01-01 and 1970-01-01. */
+#define NTFS_TIME_OFFSET	((s64)(369 * 365 + 89) * 24 * 3600 * 10000000)
+
+
 
 
 /* Forward declaration */
@@ -321,6 +376,10 @@ struct _runlist_element {/* In memory vcn to lcn mapping structure element. */
 	s64 length;	/* Run length in clusters. */
 };
 
+/* Special values of lcn in a runlist element. */
+#define LCN_HOLE	((LCN)-1)	/* Sparse run, no clusters on disk. */
+#define LCN_ENOENT	((LCN)-3)	/* Terminator of the runlist. */
+
 
 
 /**
@@ -357,6 +416,198 @@ typedef enum {
 } ATTR_TYPES;
 
 
+/**
+ * enum ATTR_FLAGS - Attribute flags (16-bit).
+ */
+typedef enum {
+	ATTR_IS_COMPRESSED	= (u16)(0x0001),
+	ATTR_COMPRESSION_MASK	= (u16)(0x00ff), /* Compression method mask.
+						    Also, first illegal
+						    value. */
+	ATTR_IS_ENCRYPTED	= (u16)(0x4000),
+	ATTR_IS_SPARSE		= (u16)(0x8000),
+} __attribute__((__packed__)) ATTR_FLAGS;
+
+
+/**
+ * struct ATTR_RECORD - Attribute record header.
+ *
+ * Always aligned to 8-byte boundary. The resident and non-resident parts
+ * share the first 16 bytes; @non_resident selects which one follows.
+ */
+typedef struct {
+/*Ofs*/
+/*  0*/	ATTR_TYPES type;	/* The (32-bit) type of the attribute. */
+/*  4*/	u32 length;		/* Byte size of the resident part of the
+				   attribute (aligned to 8-byte boundary).
+				   Used to get to the next attribute. */
+/*  8*/	u8 non_resident;	/* If 0, attribute is resident.
+				   If 1, attribute is non-resident. */
+/*  9*/	u8 name_length;		/* Unicode character size of name of attribute.
+				   0 if unnamed. */
+/* 10*/	u16 name_offset;	/* If name_length != 0, the byte offset to the
+				   beginning of the name from the attribute
+				   record. */
+/* 12*/	ATTR_FLAGS flags;	/* Flags describing the attribute. */
+/* 14*/	u16 instance;		/* The instance of this attribute record. */
+/* 16*/	union {
+		/* Resident attributes. */
+		struct {
+/* 16 */		u32 value_length; /* Byte size of attribute value. */
+/* 20 */		u16 value_offset; /* Byte offset of the attribute
+					     value from the start of the
+					     attribute record. */
+/* 22 */		u8 resident_flags; /* See RESIDENT_ATTR_FLAGS. */
+/* 23 */		s8 reservedR;	   /* Reserved/alignment to 8-byte
+					      boundary. */
+/* sizeof() = 24 bytes */
+		} __attribute__((__packed__));
+		/* Non-resident attributes. */
+		struct {
+/* 16*/			VCN lowest_vcn;	/* Lowest valid virtual cluster number
+				for this portion of the attribute value or
+				0 if this is the only extent (usually the
+				case). - Only when an attribute list is used
+				does lowest_vcn != 0 ever occur. */
+/* 24*/			VCN highest_vcn; /* Highest valid vcn of this extent of
+				the attribute value. - Usually there is only one
+				portion, so this usually equals the attribute
+				value size in clusters minus 1. Can be -1 for
+				zero length files. Can be 0 for "single extent"
+				attributes. */
+/* 32*/			u16 mapping_pairs_offset; /* Byte offset from the
+				beginning of the structure to the mapping pairs
+				array which contains the mappings between the
+				vcns and the logical cluster numbers (lcns).
+				When creating, place this at the end of this
+				record header aligned to 8-byte boundary. */
+/* 34*/			u8 compression_unit; /* The compression unit expressed
+				as the log to the base 2 of the number of
+				clusters in a compression unit. 0 means not
+				compressed. */
+/* 35*/			u8 reserved1[5];	/* Align to 8-byte boundary. */
+/* 40*/			s64 allocated_size;	/* Byte size of disk space
+				allocated to hold the attribute value. Always
+				is a multiple of the cluster size. When a file
+				is compressed, this field is a multiple of the
+				compression block size (2^compression_unit) and
+				it represents the logically allocated space
+				rather than the actual on disk usage. For this
+				use the compressed_size (see below). */
+/* 48*/			s64 data_size;	/* Byte size of the attribute
+				value. Can be larger than allocated_size if
+				attribute value is compressed or sparse. */
+/* 56*/			s64 initialized_size;	/* Byte size of initialized
+				portion of the attribute value. Usually equals
+				data_size. */
+/* sizeof(uncompressed attr) = 64*/
+/* 64*/			s64 compressed_size;	/* Byte size of the attribute
+				value after compression. Only present when
+				compressed. Always is a multiple of the
+				cluster size. Represents the actual amount of
+				disk space being used on the disk. */
+/* sizeof(compressed attr) = 72*/
+		} __attribute__((__packed__));
+	} __attribute__((__packed__));
+} __attribute__((__packed__)) ATTR_RECORD;
+
+
+/**
+ * struct STANDARD_INFORMATION - Attribute: Standard information (0x10).
+ *
+ * NOTE: Always resident. Only the leading NTFS 1.2 part is described here,
+ * the NTFS 3.x additions (owner, security and quota ids, usn) follow it.
+ */
+typedef struct {
+/*Ofs*/
+/*  0*/	s64 creation_time;		/* Time file was created. */
+/*  8*/	s64 last_data_change_time;	/* Time the data attribute was last
+					   modified. */
+/* 16*/	s64 last_mft_change_time;	/* Time this mft record was last
+					   modified. */
+/* 24*/	s64 last_access_time;		/* Approximate time when the file was
+					   last accessed. */
+/* 32*/	FILE_ATTR_FLAGS file_attributes; /* Flags describing the file. */
+/* 36*/	u32 maximum_versions;		/* Maximum allowed versions for file.
+					   Zero if version numbering is
+					   disabled. */
+/* 40*/	u32 version_number;		/* This file's version (if any). */
+/* 44*/	u32 class_id;			/* Class id from bidirectional class id
+					   index (?). */
+/* sizeof() = 48 bytes */
+} __attribute__((__packed__)) STANDARD_INFORMATION;
+
+
+/**
+ * struct ATTR_LIST_ENTRY - Attribute: Attribute list (0x20).
+ *
+ * One entry per attribute (extent) of the file, telling in which mft record
+ * it lives. Entries are sorted by type, name and lowest_vcn.
+ */
+typedef struct {
+/*Ofs*/
+/*  0*/	ATTR_TYPES type;	/* Type of referenced attribute. */
+/*  4*/	u16 length;		/* Byte size of this entry. */
+/*  6*/	u8 name_length;		/* Size in Unicode chars of the name of the
+				   attribute or 0 if unnamed. */
+/*  7*/	u8 name_offset;		/* Byte offset to beginning of attribute name
+				   (always set this to where the name would
+				   start even if unnamed). */
+/*  8*/	VCN lowest_vcn;		/* Lowest virtual cluster number of this portion
+				   of the attribute value. */
+/* 16*/	leMFT_REF mft_reference;/* The reference of the mft record holding
+				   the ATTR_RECORD for this portion of the
+				   attribute value. */
+/* 24*/	u16 instance;		/* If lowest_vcn = 0, the instance of the
+				   attribute being referenced; otherwise 0. */
+/* 26*/	ntfschar name[0];	/* Use when creating only. When reading use
+				   name_offset to determine the location of the
+				   name. */
+/* sizeof() = 26 + (attribute_name_length * 2) bytes */
+} __attribute__((__packed__)) ATTR_LIST_ENTRY;
+
+
+/**
+ * struct FILE_NAME_ATTR - Attribute: Filename (0x30).
+ *
+ * NOTE: Always resident.
+ * NOTE: All fields, except the parent_directory, are only updated when the
+ *	 filename is changed. Until then, they just become out of sync with
+ *	 reality and the more up to date values are present in the standard
+ *	 information attribute.
+ */
+typedef struct {
+/*hex ofs*/
+/*  0*/	leMFT_REF parent_directory;	/* Directory this filename is
+					   referenced from. */
+/*  8*/	s64 creation_time;		/* Time file was created. */
+/* 10*/	s64 last_data_change_time;	/* Time the data attribute was last
+					   modified. */
+/* 18*/	s64 last_mft_change_time;	/* Time this mft record was last
+					   modified. */
+/* 20*/	s64 last_access_time;		/* Last time this mft record was
+					   accessed. */
+/* 28*/	s64 allocated_size;		/* Byte size of on-disk allocated space
+					   for the data attribute.  So for
+					   normal $DATA, this is the
+					   allocated_size from the unnamed
+					   $DATA attribute and for compressed
+					   and/or sparse $DATA, this is the
+					   compressed_size from the unnamed
+					   $DATA attribute. */
+/* 30*/	s64 data_size;			/* Byte size of actual data in data
+					   attribute. */
+/* 38*/	FILE_ATTR_FLAGS file_attributes;	/* Flags describing the file. */
+/* 3c*/	u32 reparse_point_tag;		/* Type of reparse point, present only
+					   in reparse points and only if there
+					   are no EAs. */
+/* 40*/	u8 file_name_length;		/* Length of file name in
+					   (Unicode) characters. */
+/* 41*/	FILE_NAME_TYPE_FLAGS file_name_type;	/* Namespace of the file name.*/
+/* 42*/	ntfschar file_name[0];		/* File name in Unicode. */
+} __attribute__((__packed__)) FILE_NAME_ATTR;
+
+
 /**
  * struct ntfs_attr - ntfs in memory non-resident attribute structure
  * @rl:			if not NULL, the decompressed runlist
@@ -500,6 +751,18 @@ struct _ntfs_inode {
 	struct list_head attr_cache;	/* List of opened attributes. */
 };
 
+/**
+ * struct ntfs_device - The device (or image file) an NTFS volume lives on.
+ */
+struct ntfs_device {
+	char *d_name;		/* Name of the device. */
+	FILE *d_fp;		/* Stream the device was opened as. */
+	struct ntfs_cache *d_cache;	/* Block cache in front of the device,
+					   NULL if reads go straight to it. */
+	struct ntfs_direct *d_direct;	/* O_DIRECT reader the device is read
+					   through, NULL to use @d_fp. */
+};
+
 /**
  * struct _ntfs_volume - structure describing an open volume in memory.
  */
@@ -566,6 +829,9 @@ struct _ntfs_volume {
 	ntfs_inode *mftmirr_ni;	/* ntfs_inode structure for FILE_MFTMirr. */
 	ntfs_attr *mftmirr_na;	/* ntfs_attr structure for the data attribute
 				   of FILE_MFTMirr. */
+	u8 *mft_sys;		/* The mirrored mft records, fixed up, each
+				   from whichever copy is intact. */
+	struct mftmirr_stats mftmirr_stats; /* What comparing them found. */
 
 	ntfschar *upcase;	/* Upper case equivalents of all 65536 2-byte
 				   Unicode characters. Obtained from
@@ -605,6 +871,8 @@ struct filename {
 };
 
 
+struct data_overlap;
+
 struct data {
 	struct list_head list;		/* Previous/Next links */
 	char		*name;		/* Stream name in current locale */
@@ -620,11 +888,19 @@ struct data {
 	runlist_element *runlist;	/* Decoded data runs */
 	int		 percent;	/* Amount potentially recoverable */
 	void		*data;		/* If resident, a pointer to the data */
+	struct stream_digest digest;	/* Hashes, if the stream was extracted */
+	char		*path;		/* Where it was extracted to */
+	struct data_overlap *overlap;	/* Other streams on its clusters */
+	int		 nr_overlap;	/* and how many */
 };
 
 struct ufile {
 	long long	 inode;		/* MFT record number */
 	time_t		 date;		/* Last modification date/time */
+	time_t		 date_c;	/* $STANDARD_INFORMATION times: created */
+	time_t		 date_a;	/*	     altered */
+	time_t		 date_m;	/*	     mft record changed */
+	time_t		 date_r;	/*	     read */
 	struct list_head name;		/* A list of filenames */
 	struct list_head data;		/* A list of data streams */
 	char		*pref_name;	/* Preferred filename */
@@ -632,10 +908,89 @@ struct ufile {
 	long long	 max_size;	/* Largest size we find */
 	int		 attr_list;	/* MFT record may be one of many */
 	int		 directory;	/* MFT record represents a directory */
+	int		 in_use;	/* MFT record is not deleted */
+	u16		 seq_no;	/* Sequence number of the record */
 	MFT_RECORD	*mft;		/* Raw MFT record */
 };
 
+/**
+ * struct mft_table - the files of a volume, sorted by mft record number
+ */
+struct mft_table {
+	struct ufile **files;
+	long nr;
+};
+
+/* Bytes of $MFT/$DATA read per request during the sequential sweep */
+#define MFT_SCAN_CHUNK	(1 << 20)
+
+/* Bytes of $Bitmap/$DATA held by a struct lcn_scan */
+#define LCN_SCAN_WINDOW	(1 << 20)
+
+/**
+ * struct lcn_scan - reads $Bitmap front to back, a window at a time
+ * @start:	first byte of $Bitmap in @buf
+ * @len:	and how many bytes of it are there
+ */
+struct lcn_scan {
+	ntfs_volume *vol;
+	u8 *buf;
+	s64 start;
+	s64 len;
+};
+
+/**
+ * struct mft_cursor - reads the mft records of a volume in order
+ * @buf:	one chunk of $MFT, @len bytes of it from offset @pos
+ * @next:	number of the record to return next
+ * @end:	record to stop before
+ * @nr_bad:	records skipped because they failed the fixup check
+ * @stop_at_chunk_end:	return NULL rather than read the next chunk, so
+ *			records returned earlier stay valid
+ */
+struct mft_cursor {
+	ntfs_volume *vol;
+	u8 *buf;
+	size_t size;
+	s64 pos;
+	s64 len;
+	u64 next;
+	u64 end;
+	long nr_bad;
+	int stop_at_chunk_end;
+	int err;
+};
+
 
 /* Function Interfaces */
-void load_ntfs_mft(ntfs_volume *);
+ntfs_volume *ntfs_volume_open(const char *);
+ntfs_volume *ntfs_volume_open_direct(const char *, size_t, int);
+void ntfs_volume_close(ntfs_volume *);
+int load_ntfs_mft(ntfs_volume *, struct mft_table *, int);
+int ntfs_mft_cursor_init(struct mft_cursor *, ntfs_volume *, size_t, u64);
+MFT_RECORD *ntfs_mft_cursor_next(struct mft_cursor *, u64 *);
+void ntfs_mft_cursor_seek(struct mft_cursor *, u64);
+void ntfs_mft_cursor_free(struct mft_cursor *);
+struct ufile *parse_mft_record(ntfs_volume *, MFT_RECORD *, u64);
+long ntfs_mft_sweep(ntfs_volume *, int (*)(struct ufile *, u64, void *),
+		void *);
+void free_ntfs_mft(struct mft_table *);
+struct ufile *alloc_ufile(u64);
+u16 ntfs_ufile_seqno(const struct ufile *);
+void free_ufile(struct ufile *);
+struct data *ntfs_join_stream(struct ufile *, struct data *);
+void score_ntfs_mft(ntfs_volume *, const struct mft_table *);
+void list_ntfs_header(void);
+void list_ntfs_file(const struct ufile *);
 void fill_ntfs_info(ntfs_volume*, NTFS_BOOT_SECTOR);
+s64 ntfs_device_pread(struct ntfs_device *, s64, s64, void *);
+s64 ntfs_pread(ntfs_volume *, s64, s64, void *);
+s64 ntfs_rl_pread(ntfs_volume *, const runlist_element *, s64, s64, void *);
+int load_ntfs_bitmap(ntfs_volume *);
+int ntfs_lcn_scan_init(struct lcn_scan *, ntfs_volume *);
+s64 ntfs_lcn_count_free(struct lcn_scan *, LCN, s64);
+void ntfs_lcn_scan_free(struct lcn_scan *);
+int ntfs_mst_post_read_fixup(void *, u32);
+runlist_element *ntfs_decompress_runlist(const ATTR_RECORD *);
+int ntfs_ucstombs(const ntfschar *, int, char **);
+time_t ntfs2utc(s64);
@@ -0,0 +1,246 @@
+#include <stdlib.h>
+#include <string.h>
+#include "ntfs_recover.h"
+#include "overlap.h"
+
+/* One run of a stream, as [lcn, end) */
+struct ovl_run {
+   s64 lcn;
+   s64 end;
+   u32 stream;
+};
+
+struct ovl_stream {
+   struct ufile *file;
+   struct data  *d;
+};
+
+/* Clusters stream @a (deleted) shares with stream @b */
+struct ovl_pair {
+   u32 a;
+   u32 b;
+   s64 clusters;
+};
+
+struct ovl_pairs {
+   struct ovl_pair *p;
+   long            nr;
+   long            size;
+};
+
+static int ovl_run_cmp(const void *a, const void *b)
+{
+   const struct ovl_run *x = a, *y = b;
+
+   return x->lcn < y->lcn ? -1 : x->lcn > y->lcn;
+}
+
+static int ovl_pair_cmp(const void *a, const void *b)
+{
+   const struct ovl_pair *x = a, *y = b;
+
+   if(x->a != y->a)
+      return x->a < y->a ? -1 : 1;
+   return x->b < y->b ? -1 : x->b > y->b;
+}
+
+static int add_pair(struct ovl_pairs *pr, u32 a, u32 b, s64 clusters)
+{
+   if(pr->nr == pr->size)
+   {
+      long n = pr->size ? pr->size * 2 : 1024;
+      struct ovl_pair *p = realloc(pr->p, n * sizeof(*p));
+      if(p == NULL)
+         return -1;
+      pr->p = p;
+      pr->size = n;
+   }
+   pr->p[pr->nr].a = a;
+   pr->p[pr->nr].b = b;
+   pr->p[pr->nr++].clusters = clusters;
+   return 0;
+}
+
+/* The active runs are a min-heap on their end */
+static void heap_up(const struct ovl_run *runs, long *heap, long i)
+{
+   while(i > 0)
+   {
+      long p = (i - 1) / 2;
+      if(runs[heap[p]].end <= runs[heap[i]].end)
+         return;
+      long t = heap[p];
+      heap[p] = heap[i];
+      heap[i] = t;
+      i = p;
+   }
+}
+
+static void heap_down(const struct ovl_run *runs, long *heap, long n, long i)
+{
+   for(;;)
+   {
+      long l = 2 * i + 1, m = i;
+      if(l < n && runs[heap[l]].end < runs[heap[m]].end)
+         m = l;
+      if(l + 1 < n && runs[heap[l + 1]].end < runs[heap[m]].end)
+         m = l + 1;
+      if(m == i)
+         return;
+      long t = heap[i];
+      heap[i] = heap[m];
+      heap[m] = t;
+      i = m;
+   }
+}
+
+/*
+ * Sweep the runs in cluster order.  The heap holds the runs still open at
+ * the current cluster; every run that starts meets each of them, and the
+ * pairs with a deleted stream on one side are recorded.  That is
+ * O(n log n) for the sort and the heap plus one step per overlap found.
+ */
+static int sweep_runs(struct ovl_run *runs, long nr_runs,
+      const struct ovl_stream *st, struct ovl_pairs *pr)
+{
+   long *heap = malloc((nr_runs ? nr_runs : 1) * sizeof(*heap));
+   long nr_heap = 0;
+
+   if(heap == NULL)
+      return -1;
+   qsort(runs, nr_runs, sizeof(*runs), ovl_run_cmp);
+   for(long i = 0; i < nr_runs; i++)
+   {
+      const struct ovl_run *r = &runs[i];
+      while(nr_heap && runs[heap[0]].end <= r->lcn)
+      {
+         heap[0] = heap[--nr_heap];
+         heap_down(runs, heap, nr_heap, 0);
+      }
+      for(long h = 0; h < nr_heap; h++)
+      {
+         const struct ovl_run *o = &runs[heap[h]];
+         s64 n = (o->end < r->end ? o->end : r->end) - r->lcn;
+         if(o->stream == r->stream)
+            continue;
+         if((!st[r->stream].file->in_use
+                  && add_pair(pr, r->stream, o->stream, n) < 0)
+               || (!st[o->stream].file->in_use
+                  && add_pair(pr, o->stream, r->stream, n) < 0))
+         {
+            free(heap);
+            return -1;
+         }
+      }
+      heap[nr_heap] = i;
+      heap_up(runs, heap, nr_heap++);
+   }
+   free(heap);
+   return 0;
+}
+
+/* Sum the pairs per stream and hang them off the deleted streams */
+static long attach_pairs(const struct ovl_stream *st, struct ovl_pairs *pr)
+{
+   long i = 0, nr_streams = 0;
+
+   if(pr->nr)
+      qsort(pr->p, pr->nr, sizeof(*pr->p), ovl_pair_cmp);
+   while(i < pr->nr)
+   {
+      u32 a = pr->p[i].a;
+      long j = i, n = 0;
+      for(; j < pr->nr && pr->p[j].a == a; j++)
+         n += j == i || pr->p[j].b != pr->p[j - 1].b;
+
+      struct data_overlap *o = calloc(n, sizeof(*o));
+      if(o == NULL)
+         return -1;
+      n = 0;
+      for(long k = i; k < j; k++)
+      {
+         if(k > i && pr->p[k].b == pr->p[k - 1].b)
+         {
+            o[n - 1].clusters += pr->p[k].clusters;
+            continue;
+         }
+         o[n].file = st[pr->p[k].b].file;
+         o[n].data = st[pr->p[k].b].d;
+         o[n++].clusters = pr->p[k].clusters;
+      }
+      st[a].d->overlap = o;
+      st[a].d->nr_overlap = n;
+      nr_streams++;
+      i = j;
+   }
+   return nr_streams;
+}
+
+/**
+ * overlap_ntfs_mft - find the streams each deleted stream shares clusters with
+ *
+ * The runs of every non-resident stream, live or deleted, are sorted by
+ * cluster and swept once.  Each deleted stream gets the list of other
+ * streams on its clusters and how many clusters they share; when two
+ * streams claim a cluster, at most one of them still holds its contents.
+ * Returns the number of deleted streams with overlaps, or -1 on error.
+ */
+long overlap_ntfs_mft(const struct mft_table *files)
+{
+   struct ovl_stream *st = NULL;
+   struct ovl_run *runs = NULL;
+   struct ovl_pairs pr = { NULL, 0, 0 };
+   long nr_st = 0, nr_runs = 0, nr_found = -1;
+   struct list_head *item;
+
+   for(long i = 0; i < files->nr; i++)
+      list_for_each(item, &files->files[i]->data)
+      {
+         struct data *d = list_entry(item, struct data, list);
+         if(d->resident || d->runlist == NULL)
+            continue;
+         nr_st++;
+         for(runlist_element *rl = d->runlist; rl->length; rl++)
+            nr_runs += rl->lcn >= 0;
+      }
+   st = malloc((nr_st ? nr_st : 1) * sizeof(*st));
+   runs = malloc((nr_runs ? nr_runs : 1) * sizeof(*runs));
+   nr_st = nr_runs = 0;
+   for(long i = 0; st && runs && i < files->nr; i++)
+      list_for_each(item, &files->files[i]->data)
+      {
+         struct data *d = list_entry(item, struct data, list);
+         if(d->resident || d->runlist == NULL)
+            continue;
+         for(runlist_element *rl = d->runlist; rl->length; rl++)
+            if(rl->lcn >= 0)
+            {
+               runs[nr_runs].lcn = rl->lcn;
+               runs[nr_runs].end = rl->lcn + rl->length;
+               runs[nr_runs++].stream = nr_st;
+            }
+         st[nr_st].file = files->files[i];
+         st[nr_st++].d = d;
+      }
+   if(st && runs && sweep_runs(runs, nr_runs, st, &pr) == 0)
+   {
+      free(runs);
+      runs = NULL;
+      nr_found = attach_pairs(st, &pr);
+   }
+
+   printf("OVERLAP INFO\n");
+   printf("--------------------------------------------\n");
+   printf(" [INFO] Streams: %ld\n", nr_st);
+   printf(" [INFO] Runs: %ld\n", nr_runs);
+   if(nr_found >= 0)
+      printf(" [INFO] Deleted streams sharing clusters: %ld\n", nr_found);
+   else
+      fprintf(stderr, "[ERROR] Allocating memory for the overlap index "
+            "failed\n");
+   printf("\n");
+   free(pr.p);
+   free(runs);
+   free(st);
+   return nr_found;
+}
@@ -0,0 +1,25 @@
+/*
+ * overlap.h - Finding streams that claim the same clusters.
+ */
+
+#ifndef _NTFS_OVERLAP_H
+#define _NTFS_OVERLAP_H
+
+#include "type.h"
+
+struct mft_table;
+struct ufile;
+struct data;
+
+/**
+ * struct data_overlap - another stream on some of the clusters of a stream
+ */
+struct data_overlap {
+	const struct ufile *file;	/* File the other stream belongs to. */
+	const struct data *data;	/* The other stream. */
+	s64 clusters;			/* Clusters the two have in common. */
+};
+
+long overlap_ntfs_mft(const struct mft_table *);
+
+#endif /* defined _NTFS_OVERLAP_H */
@@ -0,0 +1,471 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "spill.h"
+
+#define SPILL_HEADER	20		/* u64 key, u64 seq, u32 length */
+#define SPILL_READ_SIZE	(64 << 10)	/* Read buffer of every run merged */
+
+struct spill_run {
+   off_t start;
+   off_t end;
+};
+
+/* Where the merge is in one run */
+struct spill_cursor {
+   off_t  pos;		/* Next byte of the run to read */
+   off_t  end;
+   u8     *buf;
+   size_t len;		/* Bytes in @buf */
+   size_t at;		/* Current record in @buf */
+   u64    key;
+   u64    seq;
+   u32    rec_len;
+};
+
+static int hdr_cmp(const u8 *a, const u8 *b)
+{
+   u64 ka, kb;
+
+   memcpy(&ka, a, 8);
+   memcpy(&kb, b, 8);
+   if(ka != kb)
+      return ka < kb ? -1 : 1;
+   memcpy(&ka, a + 8, 8);
+   memcpy(&kb, b + 8, 8);
+   return ka < kb ? -1 : ka > kb;
+}
+
+static int rec_cmp(const void *a, const void *b)
+{
+   return hdr_cmp(*(const u8 * const *)a, *(const u8 * const *)b);
+}
+
+/**
+ * spill_open - start an external sort
+ * @dir:	directory for the temporary file
+ * @budget:	bytes of memory it may use
+ */
+struct spill *spill_open(const char *dir, size_t budget)
+{
+   struct spill *s = calloc(1, sizeof(*s));
+
+   if(s == NULL)
+      return NULL;
+   if(budget < 4 * SPILL_READ_SIZE)
+      budget = 4 * SPILL_READ_SIZE;
+   s->dir = dir;
+   s->budget = budget & ~(size_t)7;
+   s->last = -1;
+   s->arena = malloc(s->budget);
+   if(s->arena == NULL)
+   {
+      free(s);
+      return NULL;
+   }
+   return s;
+}
+
+static char **spill_index(struct spill *s)
+{
+   return (char **)(s->arena + s->budget) - s->nr;
+}
+
+static int open_tmp(struct spill *s)
+{
+   char *path = malloc(strlen(s->dir) + sizeof("/ntfs_spill.XXXXXX"));
+   int fd = -1;
+
+   if(path)
+   {
+      sprintf(path, "%s/ntfs_spill.XXXXXX", s->dir);
+      fd = mkstemp(path);
+   }
+   if(fd >= 0)
+   {
+      /* Nobody else needs to see it, and it goes away with us */
+      unlink(path);
+      s->fp = fdopen(fd, "w+b");
+      if(s->fp == NULL)
+         close(fd);
+   }
+   free(path);
+   if(s->fp == NULL)
+   {
+      fprintf(stderr, "[ERROR] Creating a temporary file in %s failed\n",
+            s->dir);
+      return -1;
+   }
+   return 0;
+}
+
+static int add_run(struct spill *s, off_t start, off_t end)
+{
+   if(s->nr_runs == s->size_runs)
+   {
+      int n = s->size_runs ? s->size_runs * 2 : 16;
+      struct spill_run *r = realloc(s->runs, n * sizeof(*r));
+      if(r == NULL)
+         return -1;
+      s->runs = r;
+      s->size_runs = n;
+   }
+   s->runs[s->nr_runs].start = start;
+   s->runs[s->nr_runs++].end = end;
+   return 0;
+}
+
+/* Sort what is in the arena and append it to the file as a run */
+static int write_run(struct spill *s)
+{
+   char **idx = spill_index(s);
+   off_t start;
+
+   if(s->nr == 0)
+      return 0;
+   if(s->fp == NULL && open_tmp(s) < 0)
+      return -1;
+   qsort(idx, s->nr, sizeof(*idx), rec_cmp);
+   start = ftello(s->fp);
+   for(size_t i = 0; i < s->nr; i++)
+   {
+      u32 len;
+      memcpy(&len, idx[i] + 16, 4);
+      if(fwrite(idx[i], SPILL_HEADER + len, 1, s->fp) != 1)
+      {
+         fprintf(stderr, "[ERROR] Writing to the temporary file failed\n");
+         return -1;
+      }
+   }
+   s->used = 0;
+   s->nr = 0;
+   return add_run(s, start, ftello(s->fp));
+}
+
+/**
+ * spill_add - add a record of @len bytes under @key
+ *
+ * Returns 0, or -1 if the record could not be kept (it is then lost and
+ * the sort is marked bad).
+ */
+int spill_add(struct spill *s, u64 key, const void *data, u32 len)
+{
+   size_t need = SPILL_HEADER + len;
+   char *p;
+
+   if(s->err || s->arena == NULL || len > SPILL_MAX_RECORD)
+      return s->err = -1;
+   if(s->used + need + (s->nr + 1) * sizeof(char *) > s->budget
+         && write_run(s) < 0)
+      return s->err = -1;
+   p = s->arena + s->used;
+   memcpy(p, &key, 8);
+   memcpy(p + 8, &s->seq, 8);
+   memcpy(p + 16, &len, 4);
+   if(len)
+      memcpy(p + SPILL_HEADER, data, len);
+   s->nr++;
+   spill_index(s)[0] = p;
+   s->used += need;
+   s->seq++;
+   s->nr_records++;
+   return 0;
+}
+
+/**
+ * spill_write - append a record of @len bytes under @key to the open run
+ *
+ * For records that come sorted already, a run at a time: they go straight
+ * to the file, bypassing the arena, which the first one gives back.  Each
+ * run is ended with spill_end_run().  Not to be mixed with spill_add().
+ */
+int spill_write(struct spill *s, u64 key, const void *data, u32 len)
+{
+   u8 hdr[SPILL_HEADER];
+
+   if(s->err || len > SPILL_MAX_RECORD)
+      return s->err = -1;
+   if(s->fp == NULL && open_tmp(s) < 0)
+      return s->err = -1;
+   if(!s->writing)
+   {
+      free(s->arena);
+      s->arena = NULL;
+      s->nr = 0;
+      s->run_start = ftello(s->fp);
+      s->writing = 1;
+   }
+   memcpy(hdr, &key, 8);
+   memcpy(hdr + 8, &s->seq, 8);
+   memcpy(hdr + 16, &len, 4);
+   if(fwrite(hdr, SPILL_HEADER, 1, s->fp) != 1
+         || (len && fwrite(data, len, 1, s->fp) != 1))
+   {
+      fprintf(stderr, "[ERROR] Writing to the temporary file failed\n");
+      return s->err = -1;
+   }
+   s->seq++;
+   s->nr_records++;
+   return 0;
+}
+
+/**
+ * spill_end_run - end the run spill_write() has been writing
+ */
+int spill_end_run(struct spill *s)
+{
+   if(s->err)
+      return -1;
+   if(!s->writing)
+      return 0;
+   s->writing = 0;
+   if(add_run(s, s->run_start, ftello(s->fp)) < 0)
+      return s->err = -1;
+   return 0;
+}
+
+/*
+ * Make the record at @c->at whole in the buffer, reading on if need be.
+ * Returns 1 if there is one, 0 at the end of the run or -1 on error.
+ */
+static int cursor_fill(struct spill *s, struct spill_cursor *c)
+{
+   for(;;)
+   {
+      size_t avail = c->len - c->at;
+      if(avail >= SPILL_HEADER)
+      {
+         memcpy(&c->rec_len, c->buf + c->at + 16, 4);
+         if(avail >= SPILL_HEADER + c->rec_len)
+         {
+            memcpy(&c->key, c->buf + c->at, 8);
+            memcpy(&c->seq, c->buf + c->at + 8, 8);
+            return 1;
+         }
+      }
+      if(c->pos >= c->end)
+         return avail ? -1 : 0;
+      memmove(c->buf, c->buf + c->at, avail);
+      c->len = avail;
+      c->at = 0;
+      size_t want = SPILL_READ_SIZE - avail;
+      if((off_t)want > c->end - c->pos)
+         want = c->end - c->pos;
+      ssize_t n = pread(fileno(s->fp), c->buf + avail, want, c->pos);
+      if(n <= 0)
+      {
+         fprintf(stderr, "[ERROR] Reading the temporary file failed\n");
+         return -1;
+      }
+      c->len += n;
+      c->pos += n;
+   }
+}
+
+static int cursor_less(struct spill *s, int a, int b)
+{
+   struct spill_cursor *x = &s->cur[a], *y = &s->cur[b];
+
+   return x->key < y->key || (x->key == y->key && x->seq < y->seq);
+}
+
+static void sift_down(struct spill *s, int i)
+{
+   for(;;)
+   {
+      int l = 2 * i + 1, m = i;
+      if(l < s->nr_heap && cursor_less(s, s->heap[l], s->heap[m]))
+         m = l;
+      if(l + 1 < s->nr_heap && cursor_less(s, s->heap[l + 1], s->heap[m]))
+         m = l + 1;
+      if(m == i)
+         return;
+      int t = s->heap[i];
+      s->heap[i] = s->heap[m];
+      s->heap[m] = t;
+      i = m;
+   }
+}
+
+static void merge_end(struct spill *s)
+{
+   if(s->cur)
+   {
+      /* Buffers hang off the first cursor, see merge_start() */
+      free(s->cur[0].buf);
+      free(s->cur);
+   }
+   free(s->heap);
+   s->cur = NULL;
+   s->heap = NULL;
+   s->nr_heap = 0;
+   s->last = -1;
+}
+
+/* Set up a merge of @n runs starting with run @first */
+static int merge_start(struct spill *s, int first, int n)
+{
+   u8 *bufs;
+
+   s->cur = calloc(n, sizeof(*s->cur));
+   s->heap = malloc(n * sizeof(*s->heap));
+   bufs = malloc((size_t)n * SPILL_READ_SIZE);
+   if(s->cur && bufs)
+      s->cur[0].buf = bufs;
+   else
+      free(bufs);
+   if(s->cur == NULL || s->heap == NULL || bufs == NULL)
+   {
+      merge_end(s);
+      return -1;
+   }
+   s->nr_heap = 0;
+   s->last = -1;
+   for(int i = 0; i < n; i++)
+   {
+      struct spill_cursor *c = &s->cur[i];
+      c->buf = bufs + (size_t)i * SPILL_READ_SIZE;
+      c->pos = s->runs[first + i].start;
+      c->end = s->runs[first + i].end;
+      int r = cursor_fill(s, c);
+      if(r < 0)
+      {
+         merge_end(s);
+         return -1;
+      }
+      if(r)
+         s->heap[s->nr_heap++] = i;
+   }
+   for(int i = s->nr_heap / 2 - 1; i >= 0; i--)
+      sift_down(s, i);
+   return 0;
+}
+
+static const u8 *merge_next(struct spill *s)
+{
+   struct spill_cursor *c;
+
+   if(s->last >= 0)
+   {
+      c = &s->cur[s->last];
+      c->at += SPILL_HEADER + c->rec_len;
+      int r = cursor_fill(s, c);
+      if(r < 0)
+         s->err = -1;
+      if(r <= 0)
+         s->heap[0] = s->heap[--s->nr_heap];
+      sift_down(s, 0);
+      s->last = -1;
+   }
+   if(s->nr_heap == 0 || s->err)
+      return NULL;
+   s->last = s->heap[0];
+   return s->cur[s->last].buf + s->cur[s->last].at;
+}
+
+/**
+ * spill_sort - done adding, get ready to read the records back in order
+ *
+ * If everything fitted in memory it is sorted there and nothing touches
+ * the disk.  Otherwise the last run is written out and the runs merged,
+ * in more than one pass when there are more runs than read buffers fit
+ * in the budget.
+ */
+int spill_sort(struct spill *s)
+{
+   int fanin = s->budget / SPILL_READ_SIZE, first = 0;
+
+   if(spill_end_run(s) < 0)
+      return -1;
+   if(s->nr_runs == 0)
+   {
+      qsort(spill_index(s), s->nr, sizeof(char *), rec_cmp);
+      s->next = 0;
+      return 0;
+   }
+   if(write_run(s) < 0)
+      return s->err = -1;
+   free(s->arena);
+   s->arena = NULL;
+   if(fflush(s->fp) != 0)
+      return s->err = -1;
+
+   while(s->nr_runs - first > fanin)
+   {
+      off_t start = ftello(s->fp);
+      const u8 *p;
+      if(merge_start(s, first, fanin) < 0)
+         return s->err = -1;
+      while((p = merge_next(s)))
+      {
+         u32 len;
+         memcpy(&len, p + 16, 4);
+         if(fwrite(p, SPILL_HEADER + len, 1, s->fp) != 1)
+            s->err = -1;
+      }
+      merge_end(s);
+      first += fanin;
+      if(s->err || fflush(s->fp) != 0
+            || add_run(s, start, ftello(s->fp)) < 0)
+         return s->err = -1;
+   }
+   s->first = first;
+   if(merge_start(s, first, s->nr_runs - first) < 0)
+      return s->err = -1;
+   return 0;
+}
+
+/**
+ * spill_rewind - read the sorted records once more from the start
+ */
+int spill_rewind(struct spill *s)
+{
+   if(s->err)
+      return -1;
+   if(s->cur == NULL)
+   {
+      s->next = 0;
+      return 0;
+   }
+   merge_end(s);
+   if(merge_start(s, s->first, s->nr_runs - s->first) < 0)
+      return s->err = -1;
+   return 0;
+}
+
+/**
+ * spill_next - the next record in key order, or NULL at the end
+ *
+ * The record stays valid until the following call.  At the end, @s->err
+ * tells whether everything was read back.
+ */
+const void *spill_next(struct spill *s, u64 *key, u32 *len)
+{
+   const u8 *p;
+
+   if(s->err)
+      return NULL;
+   if(s->cur)
+      p = merge_next(s);
+   else if(s->arena && s->next < s->nr)
+      p = (const u8 *)spill_index(s)[s->next++];
+   else
+      p = NULL;
+   if(p == NULL)
+      return NULL;
+   memcpy(key, p, 8);
+   memcpy(len, p + 16, 4);
+   return p + SPILL_HEADER;
+}
+
+void spill_close(struct spill *s)
+{
+   if(s == NULL)
+      return;
+   merge_end(s);
+   if(s->fp)
+      fclose(s->fp);
+   free(s->arena);
+   free(s->runs);
+   free(s);
+}
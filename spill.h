@@ -0,0 +1,64 @@
+/*
+ * spill.h - Sorting more records than fit in memory.
+ */
+
+#ifndef _NTFS_SPILL_H
+#define _NTFS_SPILL_H
+
+#include <stddef.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include "type.h"
+
+/* Largest record spill_add() takes */
+#define SPILL_MAX_RECORD	(60 << 10)
+
+struct spill_run;
+struct spill_cursor;
+
+/**
+ * struct spill - an external sort of variable sized records by a u64 key
+ *
+ * Records are collected in @arena until it is full, then sorted and
+ * written out to @fp as a run.  Reading them back merges the runs.
+ * Records with the same key come back in the order they were added.
+ *
+ * @dir:	where the temporary file goes, created on the first run
+ * @arena:	records from the front, pointers to them from the back
+ * @budget:	bytes of memory the sort may use, arena or read buffers
+ * @seq:	number of records added, breaks ties between keys
+ * @run_start:	where the run spill_write() is writing starts in @fp
+ */
+struct spill {
+	const char *dir;
+	FILE *fp;
+	char *arena;
+	size_t budget;
+	size_t used;
+	size_t nr;
+	u64 seq;
+	u64 nr_records;
+	struct spill_run *runs;
+	int nr_runs;
+	int size_runs;
+	int first;			/* First run of the final merge */
+	size_t next;			/* In memory: next pointer to return */
+	struct spill_cursor *cur;	/* On disk: one cursor per run */
+	int *heap;
+	int nr_heap;
+	int last;			/* Cursor whose record went out last */
+	off_t run_start;
+	int writing;			/* A spill_write() run is open */
+	int err;
+};
+
+struct spill *spill_open(const char *, size_t);
+int spill_add(struct spill *, u64, const void *, u32);
+int spill_write(struct spill *, u64, const void *, u32);
+int spill_end_run(struct spill *);
+int spill_sort(struct spill *);
+const void *spill_next(struct spill *, u64 *, u32 *);
+int spill_rewind(struct spill *);
+void spill_close(struct spill *);
+
+#endif /* defined _NTFS_SPILL_H */
@@ -0,0 +1,688 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "ntfs_recover.h"
+#include "emit.h"
+#include "spill.h"
+#include "timeline.h"
+
+#define TL_BATCH	(16 << 10)	/* Events formatted by a worker at once */
+#define TL_MIN_SLICE	(64 << 10)	/* Fewer events than this per thread
+					   are not worth another thread */
+#define TL_SUBMIT	(1 << 20)	/* Formatted events handed to the
+					   emitter at once by timeline_close() */
+
+struct tl_sort;
+
+/* One worker's share of the files, or of the events in a radix pass */
+struct tl_slice {
+   struct tl_sort *s;
+   long           lo;
+   long           hi;
+   long           nr_events;	/* Events of its files, then where they go */
+   u64            key_or;
+   u64            key_and;
+   u64            count[256];	/* Digit histogram, then scatter offsets */
+   pthread_t      thread;
+};
+
+struct tl_sort {
+   const struct mft_table *files;
+   struct tl_event        *src;
+   struct tl_event        *dst;
+   int                    shift;
+   struct tl_slice        *sl;
+   int                    nr;
+};
+
+/* Run @fn on every slice, the first one in this thread */
+static void run_phase(struct tl_sort *s, void *(*fn)(void *))
+{
+   int i, *started = calloc(s->nr, sizeof(*started));
+
+   for(i = 1; started && i < s->nr; i++)
+      started[i] = pthread_create(&s->sl[i].thread, NULL, fn,
+            &s->sl[i]) == 0;
+   fn(&s->sl[0]);
+   for(i = 1; i < s->nr; i++)
+   {
+      if(started && started[i])
+         pthread_join(s->sl[i].thread, NULL);
+      else
+         fn(&s->sl[i]);
+   }
+   free(started);
+}
+
+/*
+ * The events of one attribute: its four times, with the ones that are the
+ * same folded into one event.  Times that were never set, 0 on disk and
+ * so long before 1970 here, give no event.  Only counts them if @ev is
+ * NULL.
+ */
+static int add_times(struct tl_event *ev, u32 idx, int source, time_t m,
+      time_t a, time_t c, time_t b)
+{
+   time_t t[4] = { m, a, c, b };
+   int n = 0;
+
+   for(int i = 0; i < 4; i++)
+   {
+      int j, macb = 0;
+      if(t[i] <= 0)
+         continue;
+      for(j = 0; j < i && t[j] != t[i]; j++)
+         ;
+      if(j < i)
+         continue;
+      for(j = i; j < 4; j++)
+         if(t[j] == t[i])
+            macb |= 1 << j;
+      if(ev)
+      {
+         ev[n].key = (u64)(s64)t[i] ^ (1ULL << 63);
+         ev[n].file = idx;
+         ev[n].macb = macb;
+         ev[n].source = source;
+         ev[n].pad = 0;
+      }
+      n++;
+   }
+   return n;
+}
+
+static long file_events(const struct ufile *file, u32 idx,
+      struct tl_event *ev)
+{
+   struct list_head *item;
+   long n;
+   int source = 0;
+
+   n = add_times(ev, idx, 0, file->date_a, file->date_r, file->date_m,
+         file->date_c);
+   list_for_each(item, &file->name)
+   {
+      struct filename *f = list_entry(item, struct filename, list);
+      if(source < 255)
+         source++;
+      n += add_times(ev ? ev + n : NULL, idx, source, f->date_a, f->date_r,
+            f->date_m, f->date_c);
+   }
+   return n;
+}
+
+static void *count_slice(void *arg)
+{
+   struct tl_slice *sl = arg;
+
+   sl->nr_events = 0;
+   for(long i = sl->lo; i < sl->hi; i++)
+      sl->nr_events += file_events(sl->s->files->files[i], i, NULL);
+   return NULL;
+}
+
+static void *fill_slice(void *arg)
+{
+   struct tl_slice *sl = arg;
+   struct tl_event *ev = sl->s->dst + sl->nr_events;
+   u64 key_or = 0, key_and = ~0ULL;
+
+   for(long i = sl->lo; i < sl->hi; i++)
+   {
+      long n = file_events(sl->s->files->files[i], i, ev);
+      for(long k = 0; k < n; k++)
+      {
+         key_or |= ev[k].key;
+         key_and &= ev[k].key;
+      }
+      ev += n;
+   }
+   sl->key_or = key_or;
+   sl->key_and = key_and;
+   return NULL;
+}
+
+static void *hist_slice(void *arg)
+{
+   struct tl_slice *sl = arg;
+   const struct tl_event *src = sl->s->src;
+   int shift = sl->s->shift;
+
+   memset(sl->count, 0, sizeof(sl->count));
+   for(long i = sl->lo; i < sl->hi; i++)
+      sl->count[(src[i].key >> shift) & 0xff]++;
+   return NULL;
+}
+
+static void *scatter_slice(void *arg)
+{
+   struct tl_slice *sl = arg;
+   const struct tl_event *src = sl->s->src;
+   struct tl_event *dst = sl->s->dst;
+   int shift = sl->s->shift;
+
+   for(long i = sl->lo; i < sl->hi; i++)
+      dst[sl->count[(src[i].key >> shift) & 0xff]++] = src[i];
+   return NULL;
+}
+
+/* Cut [0, @n) into @s->nr slices */
+static void cut_slices(struct tl_sort *s, long n)
+{
+   for(int i = 0; i < s->nr; i++)
+   {
+      s->sl[i].s = s;
+      s->sl[i].lo = n * i / s->nr;
+      s->sl[i].hi = n * (i + 1) / s->nr;
+   }
+}
+
+/*
+ * LSD radix sort of @n events on their 64-bit key, a byte per pass.  Each
+ * pass has every slice count its digits, turns the counts into where each
+ * slice's events of each digit go (slice by slice, so the sort is stable)
+ * and scatters.  Bytes that are the same in all keys, @diff tells which,
+ * are skipped; timestamps leave only four or five passes.  Returns the
+ * array the sorted events ended up in.
+ */
+static struct tl_event *radix_sort(struct tl_sort *s, struct tl_event *ev,
+      struct tl_event *tmp, long n, u64 diff, int *nr_passes)
+{
+   cut_slices(s, n);
+   for(int shift = 0; shift < 64; shift += 8)
+   {
+      if(((diff >> shift) & 0xff) == 0)
+         continue;
+      s->src = ev;
+      s->dst = tmp;
+      s->shift = shift;
+      run_phase(s, hist_slice);
+      u64 at = 0;
+      for(int d = 0; d < 256; d++)
+         for(int i = 0; i < s->nr; i++)
+         {
+            u64 c = s->sl[i].count[d];
+            s->sl[i].count[d] = at;
+            at += c;
+         }
+      run_phase(s, scatter_slice);
+      tmp = ev;
+      ev = s->dst;
+      (*nr_passes)++;
+   }
+   return ev;
+}
+
+/**
+ * tl_event_name - the name an event is about
+ * @parent:	set to the name of the directory it is in, or NULL
+ */
+const char *tl_event_name(const struct tl_event *ev, const struct ufile *file,
+      const char **parent)
+{
+   struct list_head *item;
+   int n = 0;
+
+   *parent = file->pref_pname;
+   if(ev->source == 0)
+      return file->pref_name;
+   list_for_each(item, &file->name)
+   {
+      struct filename *f = list_entry(item, struct filename, list);
+      if(++n == ev->source)
+      {
+         *parent = f->parent_name;
+         return f->name;
+      }
+   }
+   return file->pref_name;
+}
+
+/**
+ * tl_macb - @macb as the usual four characters, "m.c." and so on
+ */
+void tl_macb(u8 macb, char *s)
+{
+   s[0] = macb & TL_M ? 'm' : '.';
+   s[1] = macb & TL_A ? 'a' : '.';
+   s[2] = macb & TL_C ? 'c' : '.';
+   s[3] = macb & TL_B ? 'b' : '.';
+   s[4] = '\0';
+}
+
+struct tl_out {
+   struct emitter         *e;
+   const struct mft_table *files;
+   const struct tl_event  *ev;
+   long                   nr_events;
+   u64                    nr_batches;
+   u64                    next_batch;	/* Taken atomically by the workers */
+   u64                    base_seq;
+};
+
+static void *out_thread(void *arg)
+{
+   struct tl_out *job = arg;
+   struct emit_buf b = { NULL, 0, 0, 0 };
+   u64 i;
+
+   while((i = __atomic_fetch_add(&job->next_batch, 1, __ATOMIC_RELAXED))
+         < job->nr_batches)
+   {
+      long end = (i + 1) * TL_BATCH;
+      if(end > job->nr_events)
+         end = job->nr_events;
+      for(long n = i * TL_BATCH; n < end; n++)
+         emit_event(job->e, &b, &job->ev[n],
+               job->files->files[job->ev[n].file]);
+      emit_submit(job->e, job->base_seq + i, &b);
+   }
+   free(b.buf);
+   return NULL;
+}
+
+/* Format the events in batches on @nr_threads workers, written in order */
+static int emit_timeline(struct emitter *e, const struct mft_table *files,
+      const struct tl_event *ev, long n, int nr_threads)
+{
+   struct tl_out job = { e, files, ev, n, (n + TL_BATCH - 1) / TL_BATCH,
+      0, 0 };
+   pthread_t *threads;
+   int i;
+
+   emit_event_header(e);
+   job.base_seq = e->next_seq;
+   threads = calloc(nr_threads, sizeof(*threads));
+   for(i = 0; threads && i < nr_threads; i++)
+      if(pthread_create(&threads[i], NULL, out_thread, &job) != 0)
+         break;
+   if(threads == NULL || i == 0)
+      out_thread(&job);
+   while(i-- > 0)
+      pthread_join(threads[i], NULL);
+   free(threads);
+   return emit_flush(e);
+}
+
+static void list_event_header(void)
+{
+   printf("Date                 MACB  Src  Inode    Del  Name\n");
+   printf("--------------------------------------------\n");
+}
+
+static void list_event(const struct tl_event *ev, const struct ufile *file)
+{
+   const char *parent, *name = tl_event_name(ev, file, &parent);
+   time_t t = tl_event_time(ev);
+   struct tm tm;
+   char date[32] = "-", macb[5];
+
+   if(gmtime_r(&t, &tm))
+      strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", &tm);
+   tl_macb(ev->macb, macb);
+   printf("%-20s %s  %-4s %-8lld %c    %s%s%s\n", date, macb,
+         ev->source ? "FN" : "SI", file->inode,
+         file->in_use ? ' ' : '*', parent ? parent : "",
+         parent ? "/" : "", name ? name : "<none>");
+}
+
+static void list_timeline(const struct mft_table *files,
+      const struct tl_event *ev, long n)
+{
+   list_event_header();
+   for(long i = 0; i < n; i++)
+      list_event(&ev[i], files->files[ev[i].file]);
+}
+
+/**
+ * timeline_ntfs_mft - write every timestamp of @files out in time order
+ *
+ * Each file gives up to four events from $STANDARD_INFORMATION and four
+ * from each $FILE_NAME.  The events are 16 byte tuples built in parallel,
+ * a slice of the files per thread, and sorted with a parallel LSD radix
+ * sort on their time.  The output goes out in batches as it is formatted.
+ *
+ * On top of the whole mft table, which has to be loaded, the sort takes
+ * two event arrays, 32 bytes per event; see timeline_open() for a timeline
+ * within a memory budget.  Returns the number of events, or -1 on error.
+ */
+long timeline_ntfs_mft(const struct mft_table *files, struct emitter *e,
+      int nr_threads)
+{
+   struct tl_sort s = { files, NULL, NULL, 0, NULL, 0 };
+   struct tl_event *ev, *tmp, *sorted;
+   long n = 0;
+   int nr_passes = 0;
+   u64 key_or = 0, key_and = ~0ULL;
+
+   if(nr_threads < 1)
+      nr_threads = 1;
+   s.nr = nr_threads;
+   if(files->nr / s.nr < TL_MIN_SLICE / 8)
+      s.nr = files->nr / (TL_MIN_SLICE / 8) + 1;
+   s.sl = calloc(nr_threads, sizeof(*s.sl));
+   if(s.sl == NULL)
+      return -1;
+
+   cut_slices(&s, files->nr);
+   run_phase(&s, count_slice);
+   for(int i = 0; i < s.nr; i++)
+   {
+      long c = s.sl[i].nr_events;
+      s.sl[i].nr_events = n;
+      n += c;
+   }
+   ev = malloc((n ? n : 1) * sizeof(*ev));
+   tmp = malloc((n ? n : 1) * sizeof(*tmp));
+   if(ev == NULL || tmp == NULL)
+   {
+      fprintf(stderr, "[ERROR] Allocating memory for %ld events failed\n", n);
+      free(ev);
+      free(tmp);
+      free(s.sl);
+      return -1;
+   }
+   s.dst = ev;
+   run_phase(&s, fill_slice);
+   for(int i = 0; i < s.nr; i++)
+   {
+      key_or |= s.sl[i].key_or;
+      key_and &= s.sl[i].key_and;
+   }
+
+   s.nr = nr_threads;
+   if(n / s.nr < TL_MIN_SLICE)
+      s.nr = n / TL_MIN_SLICE + 1;
+   sorted = radix_sort(&s, ev, tmp, n, n ? key_or ^ key_and : 0,
+         &nr_passes);
+
+   printf("TIMELINE INFO\n");
+   printf("--------------------------------------------\n");
+   printf(" [INFO] Files: %ld\n", files->nr);
+   printf(" [INFO] Events: %ld\n", n);
+   printf(" [INFO] Sort passes: %d\n", nr_passes);
+   printf("\n");
+
+   if(e)
+      emit_timeline(e, files, sorted, n, nr_threads);
+   else
+      list_timeline(files, sorted, n);
+   free(ev);
+   free(tmp);
+   free(s.sl);
+   return n;
+}
+
+/*
+ * What an event of a bounded timeline carries of its file: this, then its
+ * name and its directory's, each with its '\0' (a length of 0 for none).
+ */
+struct tl_rec {
+   s64 inode;
+   u16 name_len;
+   u16 parent_len;
+   u8  macb;
+   u8  source;
+   u8  in_use;
+   u8  pad;
+};
+
+/**
+ * struct timeline - a timeline of files handed in one at a time
+ * @ev:		events of the run being collected, the @file of each is
+ *		where its struct tl_rec is in @rec
+ * @tmp:	the radix sort's other array
+ * @s:		the sorted runs, set up when the first one is written out
+ * @spill_budget:	what @s may use to merge them
+ */
+struct timeline {
+   struct emitter  *e;
+   const char      *dir;
+   size_t          spill_budget;
+   int             nr_threads;
+   struct tl_sort  sort;
+   struct tl_event *ev;
+   struct tl_event *tmp;
+   long            nr;
+   long            size;
+   u8              *rec;
+   size_t          rec_used;
+   size_t          rec_size;
+   u64             key_or;
+   u64             key_and;
+   struct spill    *s;
+   long            nr_files;
+   long            nr_events;
+   int             nr_runs;
+   int             nr_passes;
+};
+
+/* Bytes the struct tl_rec of @ev takes */
+static size_t tl_rec_len(const struct tl_event *ev, const struct ufile *file)
+{
+   const char *parent, *name = tl_event_name(ev, file, &parent);
+
+   return sizeof(struct tl_rec) + (name ? strlen(name) + 1 : 0)
+      + (parent ? strlen(parent) + 1 : 0);
+}
+
+static void tl_rec_add(struct timeline *tl, const struct tl_event *ev,
+      const struct ufile *file)
+{
+   const char *parent, *name = tl_event_name(ev, file, &parent);
+   struct tl_rec r = { file->inode, name ? strlen(name) + 1 : 0,
+      parent ? strlen(parent) + 1 : 0, ev->macb, ev->source,
+      file->in_use != 0, 0 };
+   u8 *p = tl->rec + tl->rec_used;
+
+   memcpy(p, &r, sizeof(r));
+   if(name)
+      memcpy(p + sizeof(r), name, r.name_len);
+   if(parent)
+      memcpy(p + sizeof(r) + r.name_len, parent, r.parent_len);
+   tl->ev[tl->nr] = *ev;
+   tl->ev[tl->nr++].file = tl->rec_used;
+   tl->rec_used += sizeof(r) + r.name_len + r.parent_len;
+   tl->key_or |= ev->key;
+   tl->key_and &= ev->key;
+}
+
+/* Sort the run collected so far, returns the array it ended up in */
+static struct tl_event *tl_sort_run(struct timeline *tl)
+{
+   tl->sort.nr = tl->nr_threads;
+   if(tl->nr / tl->sort.nr < TL_MIN_SLICE)
+      tl->sort.nr = tl->nr / TL_MIN_SLICE + 1;
+   return radix_sort(&tl->sort, tl->ev, tl->tmp, tl->nr,
+         tl->nr ? tl->key_or ^ tl->key_and : 0, &tl->nr_passes);
+}
+
+/* Sort the run collected so far and write it out */
+static int tl_write_run(struct timeline *tl)
+{
+   struct tl_event *ev = tl_sort_run(tl);
+
+   if(tl->s == NULL)
+      tl->s = spill_open(tl->dir, tl->spill_budget);
+   if(tl->s == NULL)
+      return -1;
+   for(long i = 0; i < tl->nr; i++)
+   {
+      const u8 *p = tl->rec + ev[i].file;
+      struct tl_rec r;
+      memcpy(&r, p, sizeof(r));
+      spill_write(tl->s, ev[i].key, p,
+            sizeof(r) + r.name_len + r.parent_len);
+   }
+   tl->nr_runs++;
+   tl->nr = 0;
+   tl->rec_used = 0;
+   tl->key_or = 0;
+   tl->key_and = ~0ULL;
+   return spill_end_run(tl->s);
+}
+
+/* Write out an event from what it carries of its file */
+static void tl_rec_out(struct timeline *tl, struct emit_buf *b, u64 key,
+      const u8 *p)
+{
+   struct tl_rec r;
+   struct ufile file;
+
+   memcpy(&r, p, sizeof(r));
+   struct tl_event ev = { key, 0, r.macb, r.source, 0 };
+   /* With no filenames, tl_event_name() gives the names kept */
+   memset(&file, 0, sizeof(file));
+   INIT_LIST_HEAD(&file.name);
+   INIT_LIST_HEAD(&file.data);
+   file.inode = r.inode;
+   file.in_use = r.in_use;
+   file.pref_name = r.name_len ? (char *)p + sizeof(r) : NULL;
+   file.pref_pname = r.parent_len ? (char *)p + sizeof(r) + r.name_len
+      : NULL;
+   if(tl->e == NULL)
+   {
+      list_event(&ev, &file);
+      return;
+   }
+   emit_event(tl->e, b, &ev, &file);
+   if(b->len >= TL_SUBMIT)
+      emit_submit(tl->e, tl->e->next_seq, b);
+}
+
+/**
+ * timeline_open - start a timeline within @budget bytes of memory
+ * @dir:	where sorted runs go when memory runs out
+ * @e:		where the events go, NULL to list them
+ *
+ * The bounded version of timeline_ntfs_mft(), for files handed in one at
+ * a time with timeline_add() rather than as a whole table.  Each event is
+ * kept with what it needs of its file, its names and inode, so the file
+ * can go.  Three quarters of @budget hold a run of events, which is radix
+ * sorted like the whole table is and, when the next file does not fit,
+ * written to @dir.  The rest is for merging the runs in the end.
+ */
+struct timeline *timeline_open(const char *dir, size_t budget,
+      struct emitter *e, int nr_threads)
+{
+   struct timeline *tl = calloc(1, sizeof(*tl));
+   size_t run = budget / 4 * 3;
+
+   if(tl == NULL)
+      return NULL;
+   if(nr_threads < 1)
+      nr_threads = 1;
+   tl->e = e;
+   tl->dir = dir;
+   tl->spill_budget = budget - run;
+   tl->nr_threads = nr_threads;
+   tl->key_and = ~0ULL;
+   /* Half for the two event arrays, half for what the events carry,
+      whose offsets have to fit in a u32 */
+   tl->size = run / 2 / (2 * sizeof(struct tl_event));
+   tl->rec_size = run / 2 < UINT32_MAX ? run / 2 : UINT32_MAX;
+   tl->ev = malloc(tl->size * sizeof(*tl->ev));
+   tl->tmp = malloc(tl->size * sizeof(*tl->tmp));
+   tl->rec = malloc(tl->rec_size);
+   tl->sort.sl = calloc(nr_threads, sizeof(*tl->sort.sl));
+   if(tl->ev == NULL || tl->tmp == NULL || tl->rec == NULL
+         || tl->sort.sl == NULL)
+   {
+      fprintf(stderr, "[ERROR] Allocating memory for the timeline failed\n");
+      timeline_close(tl);
+      return NULL;
+   }
+   return tl;
+}
+
+/**
+ * timeline_add - add the events of @file
+ *
+ * Returns 0, or -1 if the run it would not fit in could not be written.
+ */
+int timeline_add(struct timeline *tl, const struct ufile *file)
+{
+   long n = file_events(file, 0, NULL), i;
+   size_t need = 0;
+
+   if(n > tl->size)
+      return -1;
+   file_events(file, 0, tl->tmp);
+   for(i = 0; i < n; i++)
+      need += tl_rec_len(&tl->tmp[i], file);
+   if(need > tl->rec_size)
+      return -1;
+   if(tl->nr + n > tl->size || need > tl->rec_size - tl->rec_used)
+   {
+      if(tl_write_run(tl) < 0)
+         return -1;
+      /* The sort went through @tmp */
+      file_events(file, 0, tl->tmp);
+   }
+   for(i = 0; i < n; i++)
+      tl_rec_add(tl, &tl->tmp[i], file);
+   tl->nr_files++;
+   tl->nr_events += n;
+   return 0;
+}
+
+/**
+ * timeline_write - write every event added out in time order
+ *
+ * If they all fitted in one run it is sorted and written from memory,
+ * otherwise the last run goes to disk as well and the runs are merged.
+ * Returns the number of events, or -1 on error.
+ */
+long timeline_write(struct timeline *tl)
+{
+   struct emit_buf b = { NULL, 0, 0, 0 };
+   struct tl_event *ev = NULL;
+   const u8 *p;
+   u64 key;
+   u32 len;
+
+   if(tl->s == NULL)
+      ev = tl_sort_run(tl);
+   else if(tl_write_run(tl) < 0 || spill_sort(tl->s) < 0)
+      return -1;
+
+   printf("TIMELINE INFO\n");
+   printf("--------------------------------------------\n");
+   printf(" [INFO] Files: %ld\n", tl->nr_files);
+   printf(" [INFO] Events: %ld\n", tl->nr_events);
+   printf(" [INFO] Sort passes: %d\n", tl->nr_passes);
+   printf(" [INFO] Sorted runs written: %d\n", tl->nr_runs);
+   printf("\n");
+
+   if(tl->e)
+      emit_event_header(tl->e);
+   else
+      list_event_header();
+   if(ev)
+      for(long i = 0; i < tl->nr; i++)
+         tl_rec_out(tl, &b, ev[i].key, tl->rec + ev[i].file);
+   else
+      while((p = spill_next(tl->s, &key, &len)))
+         tl_rec_out(tl, &b, key, p);
+   if(tl->e)
+   {
+      emit_submit(tl->e, tl->e->next_seq, &b);
+      free(b.buf);
+   }
+   if(tl->s && tl->s->err)
+      return -1;
+   return tl->nr_events;
+}
+
+void timeline_close(struct timeline *tl)
+{
+   if(tl == NULL)
+      return;
+   spill_close(tl->s);
+   free(tl->ev);
+   free(tl->tmp);
+   free(tl->rec);
+   free(tl->sort.sl);
+   free(tl);
+}
@@ -0,0 +1,52 @@
+/*
+ * timeline.h - MACB timeline of every timestamp in the mft.
+ */
+
+#ifndef _NTFS_TIMELINE_H
+#define _NTFS_TIMELINE_H
+
+#include "type.h"
+
+struct mft_table;
+struct ufile;
+struct emitter;
+struct timeline;
+
+/* Which of the four times an event stands for */
+#define TL_M	0x01		/* Data modified */
+#define TL_A	0x02		/* Accessed */
+#define TL_C	0x04		/* Mft record changed */
+#define TL_B	0x08		/* Born */
+
+/**
+ * struct tl_event - one point on the timeline
+ *
+ * Times of an attribute that are the same make a single event with more
+ * than one MACB bit set.
+ */
+struct tl_event {
+	u64 key;		/* Time, sign bit flipped to sort unsigned. */
+	u32 file;		/* Index into the mft table; in a run of
+				   timeline_open(), offset of the event's
+				   copy of what it needs of its file. */
+	u8 macb;		/* TL_* bits. */
+	u8 source;		/* 0 for $STANDARD_INFORMATION, n for the n-th
+				   $FILE_NAME of the file. */
+	u16 pad;
+};
+
+static inline s64 tl_event_time(const struct tl_event *ev)
+{
+	return (s64)(ev->key ^ (1ULL << 63));
+}
+
+long timeline_ntfs_mft(const struct mft_table *, struct emitter *, int);
+struct timeline *timeline_open(const char *, size_t, struct emitter *, int);
+int timeline_add(struct timeline *, const struct ufile *);
+long timeline_write(struct timeline *);
+void timeline_close(struct timeline *);
+const char *tl_event_name(const struct tl_event *, const struct ufile *,
+		const char **);
+void tl_macb(u8, char *);
+
+#endif /* defined _NTFS_TIMELINE_H */
@@ -17,3 +17,6 @@ typedef s64 VCN;
 typedef s64 leVCN;
 typedef s64 LCN;
 typedef s64 leLCN;
+
+/* NTFS is little endian on disk and we only support little endian hosts. */
+#define const_cpu_to_u64(x)	((u64)(x))